@@ -0,0 +1,5 @@
+#!/bin/sh
+
+gcc src/bench.c -O3 -g -o ptbench -lm -pthread
+./ptbench "$@"
+rm ptbench
@@ -1,6 +1,6 @@
 #!/bin/sh
 
-gcc src/ptgen.c -O3 -g -o ptgen
+gcc src/ptgen.c -O3 -g -o ptgen -lm -pthread
 ./ptgen test
 dot -Tpng ast.dot -o ast.png
 latexmk -pdf ast.tex
@@ -0,0 +1,92 @@
+#!/bin/sh
+
+# Regression checks, run from the repository root
+
+set -e
+
+gcc src/ptgen.c -O3 -g -o ptgen -lm -pthread
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+# Symbols of terms dropped as zero used to end up in the string table on a cache miss only
+printf 'H = 0*zed + y\nHamiltonian = 2*sum(i,j){ c(i)*a(j) } + zed\n' > "$dir/ref.pt"
+
+./ptgen --format=bin "$dir/ref.pt" > /dev/null
+mv terms.bin "$dir/ref.bin"
+
+# terms.bin read back through the public reader in ptbin.h
+gcc check/ptbin_dump.c -O2 -g -o "$dir/ptbin_dump"
+"$dir/ptbin_dump" "$dir/ref.bin" > "$dir/ref.txt"
+printf 'H\n  1 y\nHamiltonian\n  2 sum(i,j) c_i a_j\n  1 zed\n' > "$dir/expected.txt"
+if ! cmp -s "$dir/expected.txt" "$dir/ref.txt"; then
+  echo "FAIL: ptbin round trip"
+  diff "$dir/expected.txt" "$dir/ref.txt"
+  exit 1
+fi
+echo "ok: ptbin round trip"
+
+# terms.bin has to be byte-identical for identical inputs, no matter which
+# of them hit the expansion cache
+for run in cold warm; do
+  ./ptgen --format=bin --cache-dir="$dir/cache" "$dir/ref.pt" > /dev/null
+  if ! cmp -s "$dir/ref.bin" terms.bin; then
+    echo "FAIL: single file, $run disk cache"
+    exit 1
+  fi
+  echo "ok: single file, $run disk cache"
+done
+rm -rf "$dir/cache" terms.bin
+
+# ^ is right associative and binds tighter than unary minus
+printf 'A = -x^2\nB = 2^3^2\n' > "$dir/eval.pt"
+./ptgen --format=eval --set=x=3 "$dir/eval.pt" > /dev/null
+printf '# x A B\n3\t-9\t512\n' > "$dir/expected.txt"
+if ! cmp -s "$dir/expected.txt" eval.txt; then
+  echo "FAIL: --format=eval"
+  diff "$dir/expected.txt" eval.txt
+  exit 1
+fi
+rm eval.txt
+echo "ok: --format=eval"
+
+# Deeply nested or very long inputs come back from the library as errors
+gcc check/lib_limits.c src/libptgen.c -Isrc -O2 -g -o "$dir/lib_limits" -lm -pthread
+"$dir/lib_limits" 2> /dev/null
+
+# Same for --batch, in any order, on any number of threads
+mkdir "$dir/batch"
+for i in 1 2 3 4 5 6 7 8; do
+  cp "$dir/ref.pt" "$dir/batch/f$i.pt"
+done
+
+check() {
+  for i in 1 2 3 4 5 6 7 8; do
+    if ! cmp -s "$dir/ref.bin" "$dir/batch/f$i.pt.terms.bin"; then
+      echo "FAIL: $1, f$i.pt.terms.bin differs"
+      exit 1
+    fi
+  done
+  rm "$dir"/batch/*.terms.bin
+  echo "ok: $1"
+}
+
+./ptgen --batch --format=bin --threads=1 "$dir"/batch/f*.pt
+check "batch, 1 thread"
+
+./ptgen --batch --format=bin --threads=4 "$dir"/batch/f*.pt
+check "batch, 4 threads"
+
+./ptgen --batch --format=bin --threads=4 --cache-dir="$dir/cache" "$dir"/batch/f*.pt
+check "batch, cold disk cache"
+
+./ptgen --batch --format=bin --threads=4 --cache-dir="$dir/cache" "$dir"/batch/f*.pt
+check "batch, warm disk cache"
+
+# Manifest entries are relative to the manifest, duplicates are processed once
+printf 'f1.pt\nf2.pt\n./f2.pt\n%s\n' "$dir/batch/f3.pt" > "$dir/batch/manifest"
+for i in 4 5 6 7 8; do
+  echo "f$i.pt" >> "$dir/batch/manifest"
+done
+./ptgen --batch --format=bin --threads=4 --manifest="$dir/batch/manifest" "$dir/batch/f1.pt" "$dir/batch/../batch/f1.pt"
+check "batch, manifest with duplicates"
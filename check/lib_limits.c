@@ -0,0 +1,56 @@
+/*
+ * Inputs that used to exhaust the stack have to come back from the library
+ * as an error code, or expand fine, instead of taking the host process down.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libptgen.h"
+
+static char *repeat(const char *head, const char *part, uint32_t n, const char *mid, const char *tail) {
+  uint64_t len = strlen(head) + (uint64_t) n * (strlen(part) + strlen(tail)) + strlen(mid) + 1;
+  char *buf = malloc(len);
+  char *at = buf;
+  at += sprintf(at, "%s", head);
+  for (uint32_t i = 0; i < n; ++i) {
+    at += sprintf(at, "%s", part);
+  }
+  at += sprintf(at, "%s", mid);
+  for (uint32_t i = 0; i < n; ++i) {
+    at += sprintf(at, "%s", tail);
+  }
+  return buf;
+}
+
+static int check(struct ptgen_context *ctx, const char *what, char *input, enum ptgen_error expected) {
+  const uint8_t *data;
+  uint64_t size;
+  enum ptgen_error err = ptgen_lex(ctx, what, input, strlen(input));
+  if (err == PTGEN_OK) {
+    err = ptgen_emit(ctx, PTGEN_FORMAT_BIN, &data, &size);
+  }
+  free(input);
+
+  if (err != expected) {
+    printf("FAIL: %s, got %s, expected %s\n", what, ptgen_error_string(err), ptgen_error_string(expected));
+    return 1;
+  }
+  printf("ok: %s\n", what);
+  return 0;
+}
+
+int main(void) {
+  struct ptgen_context *ctx = ptgen_context_new(NULL);
+  int failed = 0;
+
+  failed |= check(ctx, "300k factor product", repeat("H = 2", "*2", 300000, "", ""), PTGEN_OK);
+  failed |= check(ctx, "500k nested parentheses", repeat("H = ", "(", 500000, "x", ")"), PTGEN_ERR_PARSE);
+  failed |= check(ctx, "500k unary minus", repeat("H = ", "-", 500000, "x", ""), PTGEN_ERR_PARSE);
+  failed |= check(ctx, "300k power chain", repeat("H = x", "^x", 300000, "", ""), PTGEN_ERR_PARSE);
+  failed |= check(ctx, "context reusable after errors", strdup("H = 2*c(i)*a(j)"), PTGEN_OK);
+
+  ptgen_context_free(ctx);
+  return failed;
+}
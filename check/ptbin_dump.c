@@ -0,0 +1,79 @@
+/*
+ * Reads a terms.bin back through the public reader in ptbin.h and prints
+ * it as text, one statement per line followed by its terms. Also checks
+ * that truncated or corrupted copies of the file are rejected.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../src/ptbin.h"
+
+static void dump(const struct ptbin *bin) {
+  for (uint32_t i = 0; i < ptbin_num_statements(bin); ++i) {
+    const struct ptbin_statement *s = ptbin_statement(bin, i);
+    printf("%s\n", ptbin_string(bin, s->lhs));
+    for (uint64_t j = s->first_term; j < s->first_term + s->num_terms; ++j) {
+      const struct ptbin_term *t = ptbin_term(bin, j);
+      printf("  %lld", (long long) t->coeff);
+      if (t->num_sum_indices > 0) {
+        printf(" sum(");
+        for (uint32_t k = 0; k < t->num_sum_indices; ++k) {
+          printf("%s%s", k ? "," : "", ptbin_string(bin, t->sum_indices[k]));
+        }
+        printf(")");
+      }
+      for (uint32_t k = 0; k < t->num_factors; ++k) {
+        printf(" %s", ptbin_string(bin, t->tensors[k]));
+        if (t->indices[k] != PTBIN_NONE) {
+          printf("_%s", ptbin_string(bin, t->indices[k]));
+        }
+      }
+      printf("\n");
+    }
+  }
+}
+
+static int expect(const char *what, enum ptbin_error err, enum ptbin_error expected) {
+  if (err != expected) {
+    fprintf(stderr, "FAIL: %s, got %d, expected %d\n", what, err, expected);
+    return 1;
+  }
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  if (argc != 2) {
+    fprintf(stderr, "Usage: ptbin_dump terms.bin\n");
+    return 1;
+  }
+
+  struct ptbin bin;
+  if (expect("ptbin_open", ptbin_open(&bin, argv[1]), PTBIN_OK)) {
+    return 1;
+  }
+  dump(&bin);
+
+  /* malloc'd memory is suitably aligned for ptbin_from_memory() */
+  uint64_t size = bin.size;
+  uint8_t *copy = malloc(size);
+  memcpy(copy, bin.data, size);
+  ptbin_close(&bin);
+
+  int failed = 0;
+  struct ptbin tmp;
+  failed |= expect("copy", ptbin_from_memory(&tmp, copy, size), PTBIN_OK);
+  failed |= expect("truncated", ptbin_from_memory(&tmp, copy, size - 8), PTBIN_ERR_CORRUPT);
+
+  struct ptbin_header *h = (struct ptbin_header *) copy;
+  h->terms_offset += 8;
+  failed |= expect("terms past the end", ptbin_from_memory(&tmp, copy, size), PTBIN_ERR_CORRUPT);
+  h->terms_offset -= 8;
+
+  uint32_t *string_offsets = (uint32_t *) (copy + h->string_offsets_offset);
+  string_offsets[1] = string_offsets[h->num_strings] + 1;
+  failed |= expect("string past the end", ptbin_from_memory(&tmp, copy, size), PTBIN_ERR_CORRUPT);
+
+  free(copy);
+  return failed;
+}
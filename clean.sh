@@ -1,4 +1,6 @@
 rm ptgen
+rm libptgen.a
+rm libptgen.so
 
 rm *.aux
 rm *.dvi
@@ -0,0 +1,6 @@
+#!/bin/sh
+
+gcc -c src/libptgen.c -O3 -g -fPIC -o libptgen.o
+ar rcs libptgen.a libptgen.o
+gcc -shared -o libptgen.so libptgen.o -lm -pthread
+rm libptgen.o
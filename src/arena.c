@@ -0,0 +1,79 @@
+/*
+ * Bump allocator for things that share a lifetime, like the AST of one
+ * input or the strings of a symbol table. Nothing is freed individually,
+ * arena_reset() rewinds every block so a reused arena stops calling malloc
+ * once it has grown to the size of its largest input.
+ */
+
+#define ARENA_BLOCK_SIZE (64 << 10)
+
+struct arena_block {
+  struct arena_block *next;
+  u64 size;
+  u64 used;
+  u8 data[];
+};
+
+struct arena {
+  struct arena_block *first;
+  struct arena_block *curr;
+};
+
+static void *arena_alloc(struct arena *a, u64 size) {
+  size = (size + 7) & ~7ull;
+
+  /* Move on to blocks kept from before the last reset */
+  while (a->curr && a->curr->used + size > a->curr->size && a->curr->next) {
+    a->curr = a->curr->next;
+    a->curr->used = 0;
+  }
+
+  if (!a->curr || a->curr->used + size > a->curr->size) {
+    u64 block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+    struct arena_block *b = malloc(sizeof(struct arena_block) + block_size);
+    if (!b) {
+      die("Failed to malloc - %s\n", strerror(errno));
+    }
+    STATS_ADD(bytes_allocated, sizeof(struct arena_block) + block_size);
+    b->next = NULL;
+    b->size = block_size;
+    b->used = 0;
+
+    if (a->curr) {
+      b->next = a->curr->next;
+      a->curr->next = b;
+    } else {
+      a->first = b;
+    }
+    a->curr = b;
+  }
+
+  void *p = a->curr->data + a->curr->used;
+  a->curr->used += size;
+  return p;
+}
+
+static const u8 *arena_strndup(struct arena *a, const u8 *src, u64 len) {
+  u8 *str = arena_alloc(a, len+1);
+  memcpy(str, src, len);
+  str[len] = 0;
+  return str;
+}
+
+static void arena_reset(struct arena *a) {
+  a->curr = a->first;
+  if (a->curr) {
+    a->curr->used = 0;
+  }
+}
+
+static void arena_free(struct arena *a) {
+  struct arena_block *b = a->first;
+  while (b) {
+    struct arena_block *next = b->next;
+    free(b);
+    b = next;
+  }
+  a->first = NULL;
+  a->curr  = NULL;
+}
@@ -15,6 +15,8 @@ enum ast_node_type {
   AST_ANNIHI_OP,
 };
 
+_Static_assert(AST_ANNIHI_OP < STATS_MAX_NODE_TYPES, "stats can't count every node type");
+
 static const u8 * ast_node_names[] = {
   [AST_UNKNOWN] = "AST_UNKNOWN",
   [AST_CONSTANT] = "AST_CONSTANT",
@@ -44,104 +46,204 @@ struct ast_node {
   struct ast_node *children[AST_NODE_MAX_CHILDREN];
 };
 
-struct ast_node *ast_node_new() {
-  void *p = malloc(sizeof(struct ast_node));
-  if (!p) {
-    die("Failed to malloc - %s\n", strerror(errno));
+static inline u8 ast_num_children(struct ast_node *node) {
+  u8 n = 0;
+  while (n < AST_NODE_MAX_CHILDREN && node->children[n]) {
+    n++;
   }
-  struct ast_node *node = p;
+  return n;
+}
+
+/* Nodes live in the arena of the input they were parsed from */
+static struct ast_node *ast_node_new(struct arena *arena) {
+  struct ast_node *node = arena_alloc(arena, sizeof(struct ast_node));
   memset(node, 0, sizeof(struct ast_node));
   return node;
 }
 
-static void dump_node_dot_recurse(struct ast_node *root, FILE *fd) {
-  fprintf(fd, "NODE_%p [label=\"%s\\n%s\"];\n", root, ast_node_names[root->type], root->name);
-  for (u8 i = 0; i < AST_NODE_MAX_CHILDREN; ++i) {
-    if (root->children[i]) {
-      dump_node_dot_recurse(root->children[i], fd);
+/*
+ * Explicit traversal stack shared by the emitters, so deep trees don't
+ * overflow the C stack. An entry is either a node to visit or a literal
+ * string to emit (node == NULL).
+ */
+struct emit_item {
+  struct ast_node *node;
+  union {
+    u64 parent_id;  /* DOT */
+    const u8 *str;  /* LaTeX */
+    bool expanded;  /* compile(), operands are already pushed */
+  };
+};
+
+struct emit_stack {
+  struct emit_item *items;
+  u64 len;
+  u64 cap;
+};
+
+static inline void emit_push(struct emit_stack *s, struct emit_item item) {
+  if (s->len == s->cap) {
+    s->cap = s->cap ? 2*s->cap : 256;
+    s->items = realloc(s->items, s->cap * sizeof(struct emit_item));
+    if (!s->items) {
+      die("Failed to realloc - %s\n", strerror(errno));
     }
   }
+  s->items[s->len++] = item;
 }
 
-static void dump_edge_dot_recurse(struct ast_node *root, FILE *fd) {
-  for (u8 i = 0; i < AST_NODE_MAX_CHILDREN; ++i) {
-    if (root->children[i]) {
-      fprintf(fd, "NODE_%p -> NODE_%p\n", root, root->children[i]);
-      dump_edge_dot_recurse(root->children[i], fd);
-    }
+static inline void emit_push_node(struct emit_stack *s, struct ast_node *node) {
+  if (node) {
+    emit_push(s, (struct emit_item) { .node = node });
   }
 }
 
-static void dump_ast_to_dot(struct ast_node *root, const u8 *filepath) {
-  FILE *fd = fopen(filepath, "w");
-  xassert(fd, "(fopen) %s\n", strerror(errno));
+static inline void emit_push_str(struct emit_stack *s, const u8 *str) {
+  emit_push(s, (struct emit_item) { .node = NULL, .str = str });
+}
 
-  fputs("digraph {\n", fd);
-  dump_node_dot_recurse(root, fd);
-  dump_edge_dot_recurse(root, fd);
-  fputs("}\n", fd);
+static void stats_count_nodes(struct ast_node *root) {
+  struct emit_stack stack = {0};
+  emit_push_node(&stack, root);
 
-  fclose(fd);
+  while (stack.len > 0) {
+    struct ast_node *node = stack.items[--stack.len].node;
+    for (u8 i = 0; i < AST_NODE_MAX_CHILDREN; ++i) {
+      emit_push_node(&stack, node->children[i]);
+    }
+    stats.nodes[node->type]++;
+  }
+
+  free(stack.items);
 }
 
-static void dump_node_tex_recurse(struct ast_node *root, FILE *fd) {
-  switch (root->type) {
-  case AST_UNKNOWN:
-    break;
-  case AST_CONSTANT:
-    fputs(root->name, fd);
-    break;
-  case AST_TERM:
-  case AST_FACTOR:
-  case AST_UNARY_OP:
-    break;
-  case AST_BINARY_OP: {
-    dump_node_tex_recurse(root->children[0], fd);
-    fputs(root->name, fd);
-    dump_node_tex_recurse(root->children[1], fd);
-  } break;
-  case AST_VAR:
-    fputs(root->name, fd);
-    break;
-  case AST_POSTFIX:
-    break;
-  case AST_SUM:
-    fputs("\\sum_{", fd);
-    dump_node_tex_recurse(root->children[0], fd);
-    dump_node_tex_recurse(root->children[1], fd);
-    dump_node_tex_recurse(root->children[2], fd);
-    dump_node_tex_recurse(root->children[3], fd);
-    fputs("}", fd);
-    dump_node_tex_recurse(root->children[4], fd);
-    break;
-  case AST_FUN:
-    break;
-  case AST_CREATE_OP:
-    fputs("\\hat{a}^\\dagger_{", fd);
-    dump_node_tex_recurse(root->children[0], fd);
-    fputs("}", fd);
-    break;
-  case AST_ANNIHI_OP:
-    fputs("\\hat{a}_{", fd);
-    dump_node_tex_recurse(root->children[0], fd);
-    fputs("}", fd);
-    break;
-  };
+/* Nodes get dense preorder ids, edges are emitted as soon as the child is visited */
+static void dump_ast_to_dot(struct ast_node **roots, u16 num_roots, struct output *out) {
+  output_puts(out, "digraph {\n");
+
+  struct emit_stack stack = {0};
+  for (u16 i = num_roots; i-- > 0;) {
+    emit_push(&stack, (struct emit_item) { .node = roots[i], .parent_id = 0 });
+  }
+
+  u64 next_id = 1;
+  while (stack.len > 0) {
+    struct emit_item item = stack.items[--stack.len];
+    u64 id = next_id++;
+
+    output_puts(out, "NODE_");
+    output_u64(out, id);
+    output_puts(out, " [label=\"");
+    output_puts(out, ast_node_names[item.node->type]);
+    output_puts(out, "\\n");
+    output_puts(out, item.node->name);
+    output_puts(out, "\"];\n");
+
+    if (item.parent_id) {
+      output_puts(out, "NODE_");
+      output_u64(out, item.parent_id);
+      output_puts(out, " -> NODE_");
+      output_u64(out, id);
+      output_puts(out, "\n");
+    }
+
+    /* Push in reverse so children are visited left to right */
+    for (u8 i = AST_NODE_MAX_CHILDREN; i-- > 0;) {
+      if (item.node->children[i]) {
+        emit_push(&stack, (struct emit_item) { .node = item.node->children[i], .parent_id = id });
+      }
+    }
+  }
+
+  output_puts(out, "}\n");
+
+  free(stack.items);
 }
 
-static void dump_ast_to_tex(struct ast_node *root, const u8 *filepath) {
-  FILE *fd = fopen(filepath, "w");
-  xassert(fd, "(fopen) %s\n", strerror(errno));
+/* Everything is pushed in reverse order of how it should be emitted */
+static void dump_node_tex(struct ast_node *root, struct output *out) {
+  struct emit_stack stack = {0};
+  emit_push_node(&stack, root);
 
-  fputs("\\documentclass[varwidth,margin=2mm]{standalone}\n", fd);
-  fputs("\\usepackage{amsmath}\n", fd);
-  fputs("\\begin{document}\n", fd);
-  fputs("\\begin{equation}\n", fd);
+  while (stack.len > 0) {
+    struct emit_item item = stack.items[--stack.len];
+    if (!item.node) {
+      output_puts(out, item.str);
+      continue;
+    }
 
-  dump_node_tex_recurse(root, fd);
+    struct ast_node *node = item.node;
+    switch (node->type) {
+    case AST_UNKNOWN:
+      break;
+    case AST_CONSTANT:
+      output_puts(out, node->name);
+      break;
+    case AST_TERM:
+    case AST_FACTOR:
+      break;
+    case AST_UNARY_OP:
+      emit_push_node(&stack, node->children[0]);
+      output_puts(out, node->name);
+      break;
+    case AST_BINARY_OP:
+      emit_push_node(&stack, node->children[1]);
+      emit_push_str(&stack, node->name);
+      emit_push_node(&stack, node->children[0]);
+      break;
+    case AST_VAR:
+      output_puts(out, node->name);
+      break;
+    case AST_POSTFIX:
+      emit_push_str(&stack, "!");
+      emit_push_node(&stack, node->children[0]);
+      break;
+    case AST_SUM: {
+      u8 n = ast_num_children(node);
+      emit_push_node(&stack, node->children[n-1]);
+      emit_push_str(&stack, "}");
+      for (u8 i = n-1; i-- > 0;) {
+        emit_push_node(&stack, node->children[i]);
+      }
+      output_puts(out, "\\sum_{");
+    } break;
+    case AST_FUN:
+      if (strcmp(node->name, "sqrt") == 0) {
+        emit_push_str(&stack, "}");
+        emit_push_node(&stack, node->children[0]);
+        output_puts(out, "\\sqrt{");
+      } else {
+        emit_push_str(&stack, "\\right)");
+        emit_push_node(&stack, node->children[0]);
+        output_puts(out, "\\exp\\left(");
+      }
+      break;
+    case AST_CREATE_OP:
+      emit_push_str(&stack, "}");
+      emit_push_node(&stack, node->children[0]);
+      output_puts(out, "\\hat{a}^\\dagger_{");
+      break;
+    case AST_ANNIHI_OP:
+      emit_push_str(&stack, "}");
+      emit_push_node(&stack, node->children[0]);
+      output_puts(out, "\\hat{a}_{");
+      break;
+    };
+  }
 
-  fputs("\\end{equation}\n", fd);
-  fputs("\\end{document}\n", fd);
+  free(stack.items);
+}
+
+static void dump_ast_to_tex(struct ast_node **roots, u16 num_roots, struct output *out) {
+  output_puts(out, "\\documentclass[varwidth,margin=2mm]{standalone}\n");
+  output_puts(out, "\\usepackage{amsmath}\n");
+  output_puts(out, "\\begin{document}\n");
+
+  for (u16 i = 0; i < num_roots; ++i) {
+    output_puts(out, "\\begin{equation}\n");
+    dump_node_tex(roots[i], out);
+    output_puts(out, "\\end{equation}\n");
+  }
 
-  fclose(fd);
+  output_puts(out, "\\end{document}\n");
 }
@@ -0,0 +1,320 @@
+/*
+ * ptgen --batch, processes many inputs at once on a pool of --threads
+ * workers. Outputs go next to each input with the names of the single
+ * file mode appended, foo.pt gives foo.pt.ast.dot, foo.pt.ast.tex and
+ * foo.pt.terms.bin.
+ *
+ * Inputs are handed out largest first, so the batch takes about as long
+ * as its largest input once there are enough small ones to fill the other
+ * workers. Every worker owns a context, while expansions are shared
+ * through an in-memory cache layer of --cache-memory bytes (and
+ * --cache-dir if given), so a statement appearing in many inputs is
+ * expanded once.
+ */
+
+struct batch_input {
+  const u8 *path;
+  u64 size;
+  /* The input's directory resolved plus its file name, equal keys mean equal output paths */
+  u8 *key;
+};
+
+struct batch {
+  struct batch_input *inputs;
+  u32 num_inputs;
+  _Atomic u32 next_input;
+  _Atomic u32 num_failed;
+
+  u32 formats;
+  struct ptgen_options options;
+  struct cache_memory memory;
+
+  /* Stats of the main thread, workers merge theirs in when they finish */
+  struct stats *stats;
+  pthread_mutex_t stats_lock;
+};
+
+static i32 batch_input_cmp(const void *a, const void *b) {
+  const struct batch_input *ia = a;
+  const struct batch_input *ib = b;
+  if (ia->size != ib->size) {
+    return ia->size > ib->size ? -1 : 1;
+  }
+  return 0;
+}
+
+static i32 batch_input_key_cmp(const void *a, const void *b) {
+  const struct batch_input *ia = a;
+  const struct batch_input *ib = b;
+  return strcmp(ia->key, ib->key);
+}
+
+static u8 *batch_input_key(const u8 *path) {
+  const u8 *slash = strrchr(path, '/');
+  u8 *dir = slash ? strndup(path, slash == path ? 1 : slash - path) : strdup(".");
+  if (!dir) {
+    die("strdup failed - %s\n", strerror(errno));
+  }
+
+  /* Paths in directories that don't resolve fail later on, they are their own key */
+  u8 *real = realpath(dir, NULL);
+  free(dir);
+  if (!real) {
+    u8 *key = strdup(path);
+    if (!key) {
+      die("strdup failed - %s\n", strerror(errno));
+    }
+    return key;
+  }
+
+  const u8 *name = slash ? slash + 1 : path;
+  u64 len = strlen(real) + 1 + strlen(name) + 1;
+  u8 *key = malloc(len);
+  if (!key) {
+    die("Failed to malloc - %s\n", strerror(errno));
+  }
+  snprintf(key, len, "%s/%s", real, name);
+  free(real);
+  return key;
+}
+
+/* The output file a worker is writing, removed again if its input fails */
+struct batch_output {
+  struct output out;
+  u8 path[4096];
+  bool open;
+};
+
+static void batch_output_open(struct batch_output *bo, const u8 *input, const u8 *suffix) {
+  xassert(snprintf(bo->path, sizeof(bo->path), "%s%s", input, suffix) < sizeof(bo->path), "path too long: %s\n", input);
+  bo->out.fd   = -1;
+  bo->out.data = NULL;
+  bo->open     = true;
+  output_open(&bo->out, bo->path);
+}
+
+static void batch_output_close(struct batch_output *bo) {
+  output_close(&bo->out);
+  bo->open = false;
+}
+
+/* Called after a failure left bo open, a partial file is worse than none */
+static void batch_output_discard(struct batch_output *bo) {
+  if (bo->out.fd != -1) {
+    close(bo->out.fd);
+    unlink(bo->path);
+  }
+  free(bo->out.data);
+  bo->open = false;
+}
+
+/*
+ * Same as a single file run, but failures come back as an error instead of
+ * aborting. The output being written at the time is left open in bo.
+ */
+static enum ptgen_error batch_file(struct batch *b, struct ptgen_context *ctx, struct batch_input *in, struct batch_output *bo) {
+  CONTEXT_ENTER(ctx);
+
+  ctx->error = PTGEN_ERR_IO;
+  STATS_BEGIN(STATS_READ);
+  i32 fd = open(in->path, O_RDONLY);
+  xassert(fd != -1, "(open) %s: %s\n", in->path, strerror(errno));
+  struct stat st;
+  if (fstat(fd, &st) == -1) {
+    close(fd);
+    die("(fstat) %s: %s\n", in->path, strerror(errno));
+  }
+  u8 *buf = context_input(ctx, in->path, st.st_size);
+  u64 len = 0;
+  while (len < st.st_size) {
+    ssize_t n = read(fd, buf + len, st.st_size - len);
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      close(fd);
+      die("(read) %s: %s\n", in->path, n ? strerror(errno) : "unexpected end of file");
+    }
+    len += n;
+  }
+  close(fd);
+  STATS_END(STATS_READ);
+
+  context_lex(ctx, st.st_size);
+
+  /* Everything that can fail on the input runs before any output is created */
+  if (b->formats & (FORMAT_DOT | FORMAT_TEX)) {
+    context_parse(ctx);
+  }
+  if (b->formats & FORMAT_BIN) {
+    context_expand(ctx);
+  }
+
+  if (b->formats & FORMAT_DOT) {
+    batch_output_open(bo, in->path, ".ast.dot");
+    context_emit(ctx, PTGEN_FORMAT_DOT, &bo->out);
+    batch_output_close(bo);
+  }
+  if (b->formats & FORMAT_TEX) {
+    batch_output_open(bo, in->path, ".ast.tex");
+    context_emit(ctx, PTGEN_FORMAT_TEX, &bo->out);
+    batch_output_close(bo);
+  }
+  if (b->formats & FORMAT_BIN) {
+    batch_output_open(bo, in->path, ".terms.bin");
+    context_emit(ctx, PTGEN_FORMAT_BIN, &bo->out);
+    batch_output_close(bo);
+  }
+
+  CONTEXT_LEAVE(ctx);
+  return PTGEN_OK;
+}
+
+static void *batch_worker(void *arg) {
+  struct batch *b = arg;
+  stats.enabled  = b->stats->enabled;
+  stats.progress = b->stats->progress;
+
+  struct ptgen_context *ctx = ptgen_context_new(&b->options);
+  xassert(ctx, "(ptgen_context_new) %s\n", strerror(errno));
+  ctx->cache.memory = &b->memory;
+
+  for (;;) {
+    u32 i = atomic_fetch_add(&b->next_input, 1);
+    if (i >= b->num_inputs) {
+      break;
+    }
+
+    struct batch_output bo = {0};
+    enum ptgen_error err = batch_file(b, ctx, &b->inputs[i], &bo);
+    if (bo.open) {
+      batch_output_discard(&bo);
+    }
+    if (err != PTGEN_OK) {
+      atomic_fetch_add(&b->num_failed, 1);
+      fprintf(stderr, "%s: %s\n%s", b->inputs[i].path, ptgen_error_string(err), ptgen_error_message(ctx));
+    }
+  }
+
+  ptgen_context_free(ctx);
+
+  if (stats.enabled) {
+    pthread_mutex_lock(&b->stats_lock);
+    stats_merge(b->stats, &stats);
+    pthread_mutex_unlock(&b->stats_lock);
+  }
+
+  return NULL;
+}
+
+/*
+ * One input path per line, empty lines and lines starting with # are
+ * skipped. Relative paths are relative to the directory of the manifest.
+ * The paths are appended to *paths and owned by the caller.
+ */
+static u32 batch_read_manifest(const u8 *manifest, const u8 ***paths, u32 num_paths) {
+  FILE *fd = fopen(manifest, "r");
+  xassert(fd, "(fopen) %s: %s\n", manifest, strerror(errno));
+
+  const u8 *slash = strrchr(manifest, '/');
+  u64 dir_len = slash ? slash - manifest + 1 : 0;
+
+  u32 cap = num_paths;
+  char *line = NULL;
+  size_t line_cap = 0;
+  ssize_t len;
+  while ((len = getline(&line, &line_cap, fd)) != -1) {
+    while (len > 0 && isspace(line[len-1])) {
+      line[--len] = 0;
+    }
+    if (len == 0 || line[0] == '#') {
+      continue;
+    }
+
+    if (num_paths == cap) {
+      cap = cap ? 2*cap : 64;
+      *paths = realloc(*paths, cap * sizeof(const u8 *));
+      if (!*paths) {
+        die("Failed to realloc - %s\n", strerror(errno));
+      }
+    }
+    u64 prefix_len = line[0] == '/' ? 0 : dir_len;
+    u8 *path = malloc(prefix_len + len + 1);
+    if (!path) {
+      die("Failed to malloc - %s\n", strerror(errno));
+    }
+    memcpy(path, manifest, prefix_len);
+    memcpy(path + prefix_len, line, len + 1);
+    (*paths)[num_paths++] = path;
+  }
+
+  free(line);
+  fclose(fd);
+  return num_paths;
+}
+
+/* Returns the number of inputs that failed */
+static u32 batch(const u8 **paths, u32 num_paths, u32 formats, u32 num_threads, struct ptgen_options *options,
+                 u64 cache_memory_size) {
+  struct batch b = {
+    .formats    = formats,
+    .options    = *options,
+    .stats      = &stats,
+  };
+  atomic_init(&b.next_input, 0);
+  atomic_init(&b.num_failed, 0);
+  cache_memory_init(&b.memory, cache_memory_size);
+  pthread_mutex_init(&b.stats_lock, NULL);
+
+  b.inputs = malloc(num_paths * sizeof(struct batch_input));
+  if (!b.inputs) {
+    die("Failed to malloc - %s\n", strerror(errno));
+  }
+
+  /* Inputs that can't be stat'ed fail later on, in a worker */
+  for (u32 i = 0; i < num_paths; ++i) {
+    struct stat st;
+    b.inputs[i].path = paths[i];
+    b.inputs[i].size = stat(paths[i], &st) == 0 ? st.st_size : 0;
+    b.inputs[i].key  = batch_input_key(paths[i]);
+  }
+
+  /* An input listed twice would have two workers writing the same outputs */
+  qsort(b.inputs, num_paths, sizeof(struct batch_input), batch_input_key_cmp);
+  b.num_inputs = 0;
+  for (u32 i = 0; i < num_paths; ++i) {
+    if (b.num_inputs > 0 && strcmp(b.inputs[i].key, b.inputs[b.num_inputs-1].key) == 0) {
+      free(b.inputs[i].key);
+      continue;
+    }
+    b.inputs[b.num_inputs++] = b.inputs[i];
+  }
+
+  qsort(b.inputs, b.num_inputs, sizeof(struct batch_input), batch_input_cmp);
+
+  if (num_threads > b.num_inputs) {
+    num_threads = b.num_inputs;
+  }
+
+  pthread_t *threads = malloc(num_threads * sizeof(pthread_t));
+  if (!threads) {
+    die("Failed to malloc - %s\n", strerror(errno));
+  }
+  for (u32 i = 0; i < num_threads; ++i) {
+    i32 err = pthread_create(&threads[i], NULL, batch_worker, &b);
+    xassert(err == 0, "(pthread_create) %s\n", strerror(err));
+  }
+  for (u32 i = 0; i < num_threads; ++i) {
+    pthread_join(threads[i], NULL);
+  }
+
+  free(threads);
+  for (u32 i = 0; i < b.num_inputs; ++i) {
+    free(b.inputs[i].key);
+  }
+  free(b.inputs);
+  cache_memory_free(&b.memory);
+  pthread_mutex_destroy(&b.stats_lock);
+
+  return atomic_load(&b.num_failed);
+}
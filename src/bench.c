@@ -0,0 +1,382 @@
+/*
+ * Phase level benchmark
+ *
+ * Generates a synthetic input (or reads one with --input), then runs every
+ * phase of ptgen separately over a number of repetitions and prints the
+ * timings, throughput and peak RSS as a single JSON object on stdout.
+ *
+ * Generated statements look like
+ *
+ *   HA = 3*((sum(i,j,k){ TA*c(i)*c(j)*a(k) })) - 4*((sum(i,j,k){ TB*... })) + ...
+ *
+ * with --terms terms per statement, --depth levels of parentheses around
+ * every summand, --indices indices per sum and --ops creation/annihilation
+ * operators per term. The scalar TA, TB, ... is different in every term,
+ * so none of them are alike and the expanded size follows --terms.
+ */
+
+#define PTGEN_NO_MAIN
+#include "ptgen.c"
+
+struct bench_params {
+  u32 statements;
+  u32 terms;
+  u32 depth;
+  u32 indices;
+  u32 ops;
+  u32 reps;
+  const u8 *input;
+  const u8 *out_dir;
+  bool emit_input;
+};
+
+struct gen_buffer {
+  u8 *data;
+  u64 len;
+  u64 cap;
+};
+
+static void gen_write(struct gen_buffer *b, const u8 *str, u64 len) {
+  if (b->len + len + 1 > b->cap) {
+    while (b->len + len + 1 > b->cap) {
+      b->cap = b->cap ? 2*b->cap : 4096;
+    }
+    b->data = realloc(b->data, b->cap);
+    if (!b->data) {
+      die("Failed to realloc - %s\n", strerror(errno));
+    }
+  }
+  memcpy(b->data + b->len, str, len);
+  b->len += len;
+  b->data[b->len] = 0;
+}
+
+static inline void gen_puts(struct gen_buffer *b, const u8 *str) {
+  gen_write(b, str, strlen(str));
+}
+
+static inline void gen_char(struct gen_buffer *b, u8 c) {
+  gen_write(b, &c, 1);
+}
+
+/* Lowercase letters that don't start a reserved word */
+static const u8 index_names[] = "ijklmnopqr";
+
+/* Uppercase names never collide with c, a, sum, exp or sqrt */
+static void gen_name(struct gen_buffer *b, u8 first, u32 n) {
+  gen_char(b, first);
+  do {
+    gen_char(b, 'A' + n % 26);
+    n /= 26;
+  } while (n);
+}
+
+static void generate(struct gen_buffer *b, struct bench_params *params) {
+  u8 num[32];
+
+  for (u32 s = 0; s < params->statements; ++s) {
+    gen_name(b, 'H', s);
+    gen_puts(b, " = ");
+
+    for (u32 t = 0; t < params->terms; ++t) {
+      if (t > 0) {
+        gen_puts(b, t % 2 ? " - " : " + ");
+      }
+
+      snprintf(num, sizeof(num), "%u*", 1 + (s + t) % 9);
+      gen_puts(b, num);
+
+      for (u32 d = 0; d < params->depth; ++d) {
+        gen_char(b, '(');
+      }
+
+      gen_puts(b, "sum(");
+      for (u32 i = 0; i < params->indices; ++i) {
+        if (i > 0) {
+          gen_char(b, ',');
+        }
+        gen_char(b, index_names[i]);
+      }
+      gen_puts(b, "){ ");
+
+      gen_name(b, 'T', t);
+      for (u32 o = 0; o < params->ops; ++o) {
+        gen_char(b, '*');
+        gen_puts(b, 2*o < params->ops ? "c(" : "a(");
+        gen_char(b, index_names[(t + o) % params->indices]);
+        gen_char(b, ')');
+      }
+
+      gen_puts(b, " }");
+
+      for (u32 d = 0; d < params->depth; ++d) {
+        gen_char(b, ')');
+      }
+    }
+
+    gen_char(b, '\n');
+  }
+}
+
+static void read_input(struct gen_buffer *b, const u8 *filepath) {
+  FILE *fd = fopen(filepath, "r");
+  xassert(fd, "(fopen) %s\n", strerror(errno));
+
+  u8 chunk[1 << 16];
+  u64 n;
+  while ((n = fread(chunk, 1, sizeof(chunk), fd)) > 0) {
+    gen_write(b, chunk, n);
+  }
+
+  fclose(fd);
+}
+
+/* Timing */
+
+enum phase {
+  PHASE_LEX,
+  PHASE_SPLIT,
+  PHASE_PARSE,
+  PHASE_EXPAND,
+  PHASE_EMIT_DOT,
+  PHASE_EMIT_TEX,
+  PHASE_EMIT_BIN,
+  NUM_PHASES,
+};
+
+static const u8 *phase_names[] = {
+  [PHASE_LEX]      = "lex",
+  [PHASE_SPLIT]    = "split",
+  [PHASE_PARSE]    = "parse",
+  [PHASE_EXPAND]   = "expand",
+  [PHASE_EMIT_DOT] = "emit_dot",
+  [PHASE_EMIT_TEX] = "emit_tex",
+  [PHASE_EMIT_BIN] = "emit_bin",
+};
+
+struct phase_stats {
+  double min;
+  double max;
+  double total;
+};
+
+static inline void phase_record(struct phase_stats *stats, double elapsed) {
+  if (stats->total == 0 || elapsed < stats->min) {
+    stats->min = elapsed;
+  }
+  if (elapsed > stats->max) {
+    stats->max = elapsed;
+  }
+  stats->total += elapsed;
+}
+
+static u64 count_nodes(struct ast_node *root) {
+  struct emit_stack stack = {0};
+  emit_push_node(&stack, root);
+
+  u64 n = 0;
+  while (stack.len > 0) {
+    struct ast_node *node = stack.items[--stack.len].node;
+    for (u8 i = 0; i < AST_NODE_MAX_CHILDREN; ++i) {
+      emit_push_node(&stack, node->children[i]);
+    }
+    n++;
+  }
+
+  free(stack.items);
+  return n;
+}
+
+/* Escapes quotes, backslashes and control characters, e.g. in --input paths */
+static void print_json_string(const u8 *str) {
+  putchar('"');
+  for (; *str; ++str) {
+    if (*str == '"' || *str == '\\') {
+      printf("\\%c", *str);
+    } else if (*str < 0x20) {
+      printf("\\u%04x", *str);
+    } else {
+      putchar(*str);
+    }
+  }
+  putchar('"');
+}
+
+static const u8 *bench_usage =
+  "Usage: ptbench [--statements=N] [--terms=N] [--depth=N] [--indices=N] [--ops=N]\n"
+  "               [--reps=N] [--input=file] [--out-dir=dir] [--emit-input]\n";
+
+static bool parse_u32_option(const u8 *arg, const u8 *name, u32 *value) {
+  u64 len = strlen(name);
+  if (strncmp(arg, name, len) != 0 || arg[len] != '=') {
+    return false;
+  }
+  *value = strtoul(arg + len + 1, NULL, 10);
+  return true;
+}
+
+i32 main(i32 argc, u8 **argv) {
+  struct bench_params params = {
+    .statements = 4,
+    .terms      = 1000,
+    .depth      = 2,
+    .indices    = 4,
+    .ops        = 4,
+    .reps       = 10,
+    .input      = NULL,
+    .out_dir    = NULL,
+    .emit_input = false,
+  };
+
+  for (i32 i = 1; i < argc; ++i) {
+    if      (parse_u32_option(argv[i], "--statements", &params.statements)) {}
+    else if (parse_u32_option(argv[i], "--terms",      &params.terms))      {}
+    else if (parse_u32_option(argv[i], "--depth",      &params.depth))      {}
+    else if (parse_u32_option(argv[i], "--indices",    &params.indices))    {}
+    else if (parse_u32_option(argv[i], "--ops",        &params.ops))        {}
+    else if (parse_u32_option(argv[i], "--reps",       &params.reps))       {}
+    else if (strncmp(argv[i], "--input=", 8) == 0)    params.input   = argv[i] + 8;
+    else if (strncmp(argv[i], "--out-dir=", 10) == 0) params.out_dir = argv[i] + 10;
+    else if (strcmp(argv[i], "--emit-input") == 0)    params.emit_input = true;
+    else die(bench_usage);
+  }
+
+  xassert(params.statements > 0 && params.terms > 0 && params.indices > 0 &&
+          params.ops > 0 && params.reps > 0, "only --depth may be zero\n");
+  xassert(params.statements <= MAX_NUM_STATEMENTS, "--statements at most %u\n", MAX_NUM_STATEMENTS);
+  xassert(params.indices <= AST_NODE_MAX_CHILDREN-1 && params.indices <= TERM_MAX_SUM_INDICES,
+          "--indices at most %u\n", AST_NODE_MAX_CHILDREN-1);
+  /* One factor of every term is the scalar */
+  xassert(params.ops < TERM_MAX_FACTORS, "--ops at most %u\n", TERM_MAX_FACTORS-1);
+
+  struct gen_buffer input = {0};
+  if (params.input) {
+    read_input(&input, params.input);
+  } else {
+    generate(&input, &params);
+  }
+  /* Makes sure the buffer exists and is NUL terminated even for empty input */
+  gen_write(&input, "", 0);
+
+  if (params.emit_input) {
+    fwrite(input.data, 1, input.len, stdout);
+    return 0;
+  }
+
+  u8 dot_path[4096], tex_path[4096], bin_path[4096];
+  if (params.out_dir) {
+    snprintf(dot_path, sizeof(dot_path), "%s/ast.dot", params.out_dir);
+    snprintf(tex_path, sizeof(tex_path), "%s/ast.tex", params.out_dir);
+    snprintf(bin_path, sizeof(bin_path), "%s/terms.bin", params.out_dir);
+  } else {
+    strcpy(dot_path, "/dev/null");
+    strcpy(tex_path, "/dev/null");
+    strcpy(bin_path, "/dev/null");
+  }
+
+  const u8 *filepath = params.input ? params.input : (const u8 *) "<generated>";
+
+  struct phase_stats stats[NUM_PHASES] = {0};
+  struct token_buffer tok_buf = {0};
+  struct statement_range ranges[MAX_NUM_STATEMENTS];
+  struct ast_node *roots[MAX_NUM_STATEMENTS];
+  struct expansion es[MAX_NUM_STATEMENTS] = {0};
+  struct arena arena = {0};
+  struct symbol_table tab = {0};
+  struct output out;
+
+  u64 num_nodes = 0;
+  u64 num_terms = 0;
+  u16 num_statements = 0;
+
+  for (u32 rep = 0; rep < params.reps; ++rep) {
+    double t0, t1;
+
+    t0 = stats_now();
+    lex(&tok_buf, filepath, input.data, input.len);
+    t1 = stats_now();
+    phase_record(&stats[PHASE_LEX], t1 - t0);
+
+    t0 = stats_now();
+    num_statements = split_statements(&tok_buf, ranges);
+    t1 = stats_now();
+    phase_record(&stats[PHASE_SPLIT], t1 - t0);
+
+    t0 = stats_now();
+    for (u16 i = 0; i < num_statements; ++i) {
+      roots[i] = parse(&tok_buf, &ranges[i], &arena);
+    }
+    t1 = stats_now();
+    phase_record(&stats[PHASE_PARSE], t1 - t0);
+
+    t0 = stats_now();
+    for (u16 i = 0; i < num_statements; ++i) {
+      expand(&es[i], roots[i], &tab);
+    }
+    t1 = stats_now();
+    phase_record(&stats[PHASE_EXPAND], t1 - t0);
+
+    t0 = stats_now();
+    output_open(&out, dot_path);
+    dump_ast_to_dot(roots, num_statements, &out);
+    output_close(&out);
+    t1 = stats_now();
+    phase_record(&stats[PHASE_EMIT_DOT], t1 - t0);
+
+    t0 = stats_now();
+    output_open(&out, tex_path);
+    dump_ast_to_tex(roots, num_statements, &out);
+    output_close(&out);
+    t1 = stats_now();
+    phase_record(&stats[PHASE_EMIT_TEX], t1 - t0);
+
+    t0 = stats_now();
+    output_open(&out, bin_path);
+    dump_terms_to_bin(es, num_statements, &tab, &out);
+    output_close(&out);
+    t1 = stats_now();
+    phase_record(&stats[PHASE_EMIT_BIN], t1 - t0);
+
+    num_nodes = 0;
+    num_terms = 0;
+    for (u16 i = 0; i < num_statements; ++i) {
+      num_nodes += count_nodes(roots[i]);
+      num_terms += es[i].list.num_terms;
+    }
+    arena_reset(&arena);
+    symbol_table_clear(&tab);
+  }
+
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+
+  printf("{\n");
+  printf("  \"params\": {\"statements\": %u, \"terms\": %u, \"depth\": %u, \"indices\": %u, \"ops\": %u, \"reps\": %u, \"input\": ",
+         params.statements, params.terms, params.depth, params.indices, params.ops, params.reps);
+  print_json_string(params.input ? params.input : (const u8 *) "");
+  printf("},\n");
+  printf("  \"input\": {\"bytes\": %llu, \"tokens\": %u, \"statements\": %u, \"nodes\": %llu, \"terms\": %llu},\n",
+         input.len, tok_buf.num_tokens, num_statements, num_nodes, num_terms);
+  printf("  \"phases\": [\n");
+  for (u32 i = 0; i < NUM_PHASES; ++i) {
+    struct phase_stats *s = &stats[i];
+    double best = s->min > 0 ? s->min : 1e-9;
+    printf("    {\"name\": \"%s\", \"min_s\": %.9f, \"mean_s\": %.9f, \"max_s\": %.9f, "
+           "\"mb_per_s\": %.3f, \"tokens_per_s\": %.0f, \"nodes_per_s\": %.0f}%s\n",
+           phase_names[i], s->min, s->total / params.reps, s->max,
+           input.len / best / 1e6, tok_buf.num_tokens / best, num_nodes / best,
+           i+1 < NUM_PHASES ? "," : "");
+  }
+  printf("  ],\n");
+  printf("  \"peak_rss_kb\": %ld\n", usage.ru_maxrss);
+  printf("}\n");
+
+  for (u16 i = 0; i < MAX_NUM_STATEMENTS; ++i) {
+    term_list_free(&es[i].list);
+  }
+  arena_free(&arena);
+  symbol_table_free(&tab);
+  free(tok_buf.tokens);
+  free(input.data);
+  return 0;
+}
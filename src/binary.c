@@ -0,0 +1,134 @@
+/* Writer for the format described in ptbin.h */
+
+_Static_assert(TERM_MAX_FACTORS == PTBIN_MAX_FACTORS, "term/ptbin factor mismatch");
+_Static_assert(TERM_MAX_SUM_INDICES == PTBIN_MAX_SUM_INDICES, "term/ptbin sum index mismatch");
+
+static inline u64 align8(u64 x) {
+  return (x + 7) & ~7ull;
+}
+
+static void output_pad8(struct output *out, u64 written) {
+  static const u8 zeros[8] = {0};
+  output_write(out, zeros, align8(written) - written);
+}
+
+/*
+ * The string table only holds the symbols the emitted terms refer to, in
+ * order of first use. Symbol ids depend on what was interned before, e.g.
+ * whether a statement came from the cache or was expanded, while this
+ * order only depends on the terms, so equal inputs give equal files.
+ */
+struct bin_strings {
+  u32 *map;       /* symbol id -> string id, SYMBOL_NONE if unused */
+  u32 *symbols;   /* string id -> symbol id */
+  u32 num_strings;
+  u64 data_size;
+};
+
+static inline u32 bin_string(struct bin_strings *bs, struct symbol_table *tab, u32 id) {
+  if (id == SYMBOL_NONE) {
+    return PTBIN_NONE;
+  }
+  if (bs->map[id] == SYMBOL_NONE) {
+    bs->map[id] = bs->num_strings;
+    bs->symbols[bs->num_strings++] = id;
+    bs->data_size += tab->lens[id] + 1;
+  }
+  return bs->map[id];
+}
+
+static void dump_terms_to_bin(struct expansion *es, u16 num_statements, struct symbol_table *tab, struct output *out) {
+  struct bin_strings bs = {
+    .map     = malloc(((u64)tab->num_symbols+1) * sizeof(u32)),
+    .symbols = malloc(((u64)tab->num_symbols+1) * sizeof(u32)),
+  };
+  if (!bs.map || !bs.symbols) {
+    free(bs.map);
+    free(bs.symbols);
+    die("Failed to malloc - %s\n", strerror(errno));
+  }
+  memset(bs.map, 0xff, tab->num_symbols * sizeof(u32));
+
+  u64 num_terms = 0;
+  for (u16 i = 0; i < num_statements; ++i) {
+    bin_string(&bs, tab, es[i].lhs);
+    for (u64 j = 0; j < es[i].list.num_terms; ++j) {
+      struct term *t = &es[i].list.terms[j];
+      for (u8 k = 0; k < t->num_factors; ++k) {
+        bin_string(&bs, tab, t->tensors[k]);
+        bin_string(&bs, tab, t->indices[k]);
+      }
+      for (u8 k = 0; k < t->num_sum_indices; ++k) {
+        bin_string(&bs, tab, t->sum_indices[k]);
+      }
+    }
+    num_terms += es[i].list.num_terms;
+  }
+  if (bs.data_size > 0xffffffffull) {
+    free(bs.map);
+    free(bs.symbols);
+    die("string table too large for ptbin\n");
+  }
+
+  struct ptbin_header h = {
+    .magic          = PTBIN_MAGIC,
+    .version        = PTBIN_VERSION,
+    .num_strings    = bs.num_strings,
+    .num_statements = num_statements,
+    .num_terms      = num_terms,
+  };
+  h.string_offsets_offset = align8(sizeof(struct ptbin_header));
+  h.string_data_offset    = align8(h.string_offsets_offset + 4*((u64)bs.num_strings+1));
+  h.statements_offset     = align8(h.string_data_offset + bs.data_size);
+  h.terms_offset          = h.statements_offset + num_statements * sizeof(struct ptbin_statement);
+  h.file_size             = h.terms_offset + num_terms * sizeof(struct ptbin_term);
+
+  output_write(out, (const u8 *) &h, sizeof(h));
+  output_pad8(out, sizeof(h));
+
+  u32 offset = 0;
+  for (u32 i = 0; i < bs.num_strings; ++i) {
+    output_write(out, (const u8 *) &offset, 4);
+    offset += tab->lens[bs.symbols[i]] + 1;
+  }
+  output_write(out, (const u8 *) &offset, 4);
+  output_pad8(out, 4*((u64)bs.num_strings+1));
+
+  for (u32 i = 0; i < bs.num_strings; ++i) {
+    output_write(out, tab->strings[bs.symbols[i]], tab->lens[bs.symbols[i]] + 1);
+  }
+  output_pad8(out, bs.data_size);
+
+  u64 first_term = 0;
+  for (u16 i = 0; i < num_statements; ++i) {
+    struct ptbin_statement rec = {
+      .lhs        = bin_string(&bs, tab, es[i].lhs),
+      .first_term = first_term,
+      .num_terms  = es[i].list.num_terms,
+    };
+    output_write(out, (const u8 *) &rec, sizeof(rec));
+    first_term += es[i].list.num_terms;
+  }
+
+  for (u16 i = 0; i < num_statements; ++i) {
+    for (u64 j = 0; j < es[i].list.num_terms; ++j) {
+      struct term *t = &es[i].list.terms[j];
+      struct ptbin_term rec = {
+        .coeff           = t->coeff,
+        .num_factors     = t->num_factors,
+        .num_sum_indices = t->num_sum_indices,
+      };
+      for (u8 k = 0; k < t->num_factors; ++k) {
+        rec.tensors[k] = bin_string(&bs, tab, t->tensors[k]);
+        rec.indices[k] = bin_string(&bs, tab, t->indices[k]);
+      }
+      for (u8 k = 0; k < t->num_sum_indices; ++k) {
+        rec.sum_indices[k] = bin_string(&bs, tab, t->sum_indices[k]);
+      }
+      output_write(out, (const u8 *) &rec, sizeof(rec));
+    }
+  }
+
+  free(bs.map);
+  free(bs.symbols);
+}
@@ -0,0 +1,550 @@
+/*
+ * Content addressed on-disk cache of expanded statements.
+ *
+ * The key of a statement is its normalized token stream (whitespace and
+ * comments don't matter) prefixed by everything that affects the layout of
+ * the stored result. Entries live in one file each, named by the 64-bit
+ * hash of the key, and store the full key so hash collisions are detected
+ * on load. Recency is tracked through the file mtime, which is bumped on
+ * every hit; once the directory grows past max_size the least recently
+ * used entries are removed.
+ *
+ * Contexts of one process can also share a struct cache_memory, an in
+ * memory layer holding entries in the same format. It is read-mostly, a
+ * lookup only takes the read lock. Nothing is ever evicted from it, once
+ * it reaches its max_size (--cache-memory) new entries are only stored
+ * on disk, if at all.
+ *
+ * Entry layout, native endianness since the cache is local:
+ *
+ *   u8  magic[4]
+ *   u32 key_len
+ *   u8  key[key_len]
+ *   u32 lhs
+ *   u32 num_strings
+ *   { u32 len; u8 str[len]; } strings[num_strings]
+ *   u64 num_terms
+ *   struct term terms[num_terms]      ids refer to the entry's strings
+ */
+
+#define CACHE_MAGIC   "PTGC"
+#define CACHE_VERSION 2
+#define CACHE_DEFAULT_MAX_SIZE (64ull << 20)
+
+#define CACHE_MEMORY_DEFAULT_MAX_SIZE (256ull << 20)
+
+struct cache_memory_entry {
+  u64 hash;
+  u8 *data;
+  u64 size;
+};
+
+struct cache_memory {
+  pthread_rwlock_t lock;
+  struct cache_memory_entry *entries;
+  u64 num_entries;
+  u64 num_buckets;
+  u64 size;
+  u64 max_size;
+};
+
+struct cache {
+  const u8 *dir;
+  u64 max_size;
+  struct cache_memory *memory;
+};
+
+static inline bool cache_enabled(struct cache *c) {
+  return c->dir || c->memory;
+}
+
+struct cache_key {
+  u8 *data;
+  u32 len;
+  u32 cap;
+  u64 hash;
+};
+
+static inline void cache_key_append(struct cache_key *key, const void *data, u32 len) {
+  if (key->len + len > key->cap) {
+    while (key->len + len > key->cap) {
+      key->cap = key->cap ? 2*key->cap : 256;
+    }
+    key->data = realloc(key->data, key->cap);
+    if (!key->data) {
+      die("Failed to realloc - %s\n", strerror(errno));
+    }
+  }
+  memcpy(key->data + key->len, data, len);
+  key->len += len;
+}
+
+static void cache_key_build(struct cache_key *key, struct token_buffer *tok_buf, struct statement_range *range) {
+  key->len = 0;
+
+  /* Anything that changes what an entry decodes to goes in here */
+  u32 options[] = {
+    CACHE_VERSION,
+    sizeof(struct term),
+    TERM_MAX_FACTORS,
+    TERM_MAX_SUM_INDICES,
+  };
+  cache_key_append(key, options, sizeof(options));
+
+  for (u32 i = range->first_tok; i < range->end_tok; ++i) {
+    struct token *tok = &tok_buf->tokens[i];
+    u8 type = tok->type;
+    cache_key_append(key, &type, 1);
+    if (tok->type == NUMBER || tok->type == IDENTIFIER) {
+      /* Exact, the lexer rejects tokens longer than TOKEN_MAX_LEN */
+      cache_key_append(key, &tok->loc.len, 1);
+      cache_key_append(key, tok->loc.at, tok->loc.len);
+    }
+  }
+
+  u64 hash = 14695981039346656037ull;
+  for (u32 i = 0; i < key->len; ++i) {
+    hash ^= key->data[i];
+    hash *= 1099511628211ull;
+  }
+  key->hash = hash;
+}
+
+static void cache_entry_path(struct cache *c, struct cache_key *key, u8 *path, u64 size) {
+  snprintf(path, size, "%s/%016llx.ptc", c->dir, key->hash);
+}
+
+/* Bounds checked reads out of a loaded entry */
+struct cache_reader {
+  const u8 *at;
+  const u8 *end;
+};
+
+static inline bool cache_read(struct cache_reader *r, void *dst, u64 len) {
+  if (len > (u64)(r->end - r->at)) {
+    return false;
+  }
+  memcpy(dst, r->at, len);
+  r->at += len;
+  return true;
+}
+
+static inline bool cache_term_valid(struct term *t, u32 num_strings) {
+  if (t->num_factors > TERM_MAX_FACTORS || t->num_sum_indices > TERM_MAX_SUM_INDICES) {
+    return false;
+  }
+  for (u8 j = 0; j < t->num_factors; ++j) {
+    if (t->tensors[j] >= num_strings || (t->indices[j] >= num_strings && t->indices[j] != SYMBOL_NONE)) {
+      return false;
+    }
+  }
+  for (u8 j = 0; j < t->num_sum_indices; ++j) {
+    if (t->sum_indices[j] >= num_strings) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/* The whole entry is validated before anything is interned, a corrupt one leaves tab untouched */
+static bool cache_decode(const u8 *data, u64 size, struct cache_key *key,
+                         struct symbol_table *tab, struct expansion *e) {
+  struct cache_reader r = { .at = data, .end = data + size };
+
+  u8 magic[4];
+  u32 key_len;
+  if (!cache_read(&r, magic, 4) || memcmp(magic, CACHE_MAGIC, 4) != 0 ||
+      !cache_read(&r, &key_len, 4) || key_len != key->len ||
+      key_len > (u64)(r.end - r.at) || memcmp(r.at, key->data, key_len) != 0) {
+    return false;
+  }
+  r.at += key_len;
+
+  u32 lhs, num_strings;
+  if (!cache_read(&r, &lhs, 4) || !cache_read(&r, &num_strings, 4) ||
+      num_strings > (u64)(r.end - r.at) / 4 || lhs >= num_strings) {
+    return false;
+  }
+
+  const u8 *strings = r.at;
+  for (u32 i = 0; i < num_strings; ++i) {
+    u32 len;
+    if (!cache_read(&r, &len, 4) || len > (u64)(r.end - r.at)) {
+      return false;
+    }
+    r.at += len;
+  }
+
+  u64 num_terms;
+  if (!cache_read(&r, &num_terms, 8) || num_terms != (u64)(r.end - r.at) / sizeof(struct term) ||
+      (u64)(r.end - r.at) % sizeof(struct term) != 0) {
+    return false;
+  }
+
+  /* Terms aren't necessarily aligned within the entry */
+  const u8 *terms = r.at;
+  for (u64 i = 0; i < num_terms; ++i) {
+    struct term t;
+    if (!cache_read(&r, &t, sizeof(struct term)) || !cache_term_valid(&t, num_strings)) {
+      return false;
+    }
+  }
+
+  /* Map the entry's string ids onto the symbol table of this run */
+  u32 *map = malloc((num_strings+1) * sizeof(u32));
+  if (!map) {
+    die("Failed to malloc - %s\n", strerror(errno));
+  }
+
+  r.at = strings;
+  for (u32 i = 0; i < num_strings; ++i) {
+    u32 len = 0;
+    cache_read(&r, &len, 4);
+    map[i] = symbol_intern(tab, r.at, len);
+    r.at += len;
+  }
+
+  e->list.num_terms = 0;
+  e->lhs = map[lhs];
+
+  r.at = terms;
+  for (u64 i = 0; i < num_terms; ++i) {
+    struct term *t = term_list_push(&e->list);
+    cache_read(&r, t, sizeof(struct term));
+    for (u8 j = 0; j < t->num_factors; ++j) {
+      t->tensors[j] = map[t->tensors[j]];
+      t->indices[j] = t->indices[j] == SYMBOL_NONE ? SYMBOL_NONE : map[t->indices[j]];
+    }
+    for (u8 j = 0; j < t->num_sum_indices; ++j) {
+      t->sum_indices[j] = map[t->sum_indices[j]];
+    }
+  }
+
+  free(map);
+  return true;
+}
+
+static void cache_memory_init(struct cache_memory *m, u64 max_size) {
+  memset(m, 0, sizeof(struct cache_memory));
+  pthread_rwlock_init(&m->lock, NULL);
+  m->max_size = max_size;
+}
+
+static void cache_memory_free(struct cache_memory *m) {
+  for (u64 i = 0; i < m->num_buckets; ++i) {
+    free(m->entries[i].data);
+  }
+  free(m->entries);
+  pthread_rwlock_destroy(&m->lock);
+}
+
+/* Open addressing on the key hash, entries with data == NULL are empty */
+static bool cache_memory_load(struct cache_memory *m, struct cache_key *key, struct symbol_table *tab, struct expansion *e) {
+  bool hit = false;
+
+  pthread_rwlock_rdlock(&m->lock);
+  if (m->num_buckets > 0) {
+    u64 b = key->hash & (m->num_buckets-1);
+    while (m->entries[b].data) {
+      struct cache_memory_entry *entry = &m->entries[b];
+      if (entry->hash == key->hash && cache_decode(entry->data, entry->size, key, tab, e)) {
+        hit = true;
+        break;
+      }
+      b = (b+1) & (m->num_buckets-1);
+    }
+  }
+  pthread_rwlock_unlock(&m->lock);
+
+  return hit;
+}
+
+/* Takes ownership of data */
+static void cache_memory_store(struct cache_memory *m, u64 hash, u8 *data, u64 size) {
+  pthread_rwlock_wrlock(&m->lock);
+
+  if (m->size + size > m->max_size) {
+    pthread_rwlock_unlock(&m->lock);
+    free(data);
+    return;
+  }
+
+  /* Keep load factor below 1/2 */
+  if (2*(m->num_entries+1) > m->num_buckets) {
+    u64 num_buckets = m->num_buckets ? 2*m->num_buckets : 256;
+    struct cache_memory_entry *entries = calloc(num_buckets, sizeof(struct cache_memory_entry));
+    if (!entries) {
+      die("Failed to calloc - %s\n", strerror(errno));
+    }
+    for (u64 i = 0; i < m->num_buckets; ++i) {
+      if (m->entries[i].data) {
+        u64 b = m->entries[i].hash & (num_buckets-1);
+        while (entries[b].data) {
+          b = (b+1) & (num_buckets-1);
+        }
+        entries[b] = m->entries[i];
+      }
+    }
+    free(m->entries);
+    m->entries = entries;
+    m->num_buckets = num_buckets;
+  }
+
+  /* Another context may have stored the same entry since our lookup */
+  u64 b = hash & (m->num_buckets-1);
+  while (m->entries[b].data) {
+    struct cache_memory_entry *entry = &m->entries[b];
+    if (entry->hash == hash && entry->size == size && memcmp(entry->data, data, size) == 0) {
+      pthread_rwlock_unlock(&m->lock);
+      free(data);
+      return;
+    }
+    b = (b+1) & (m->num_buckets-1);
+  }
+
+  m->entries[b] = (struct cache_memory_entry) {
+    .hash = hash,
+    .data = data,
+    .size = size,
+  };
+  m->num_entries++;
+  m->size += size;
+
+  pthread_rwlock_unlock(&m->lock);
+}
+
+static bool cache_file_load(struct cache *c, struct cache_key *key, struct symbol_table *tab, struct expansion *e) {
+  u8 path[4096];
+  cache_entry_path(c, key, path, sizeof(path));
+
+  i32 fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    return false;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) == -1 || st.st_size == 0) {
+    close(fd);
+    return false;
+  }
+
+  void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (data == MAP_FAILED) {
+    close(fd);
+    return false;
+  }
+
+  bool hit = cache_decode(data, st.st_size, key, tab, e);
+  if (hit) {
+    /* Mark as recently used */
+    futimens(fd, NULL);
+  }
+
+  munmap(data, st.st_size);
+  close(fd);
+  return hit;
+}
+
+static void cache_encode(struct output *out, struct cache_key *key, struct symbol_table *tab, struct expansion *e) {
+  /* Entries carry their own compact string table */
+  u32 *map = malloc(tab->num_symbols * sizeof(u32));
+  u32 *strings = malloc(tab->num_symbols * sizeof(u32));
+  if (!map || !strings) {
+    die("Failed to malloc - %s\n", strerror(errno));
+  }
+  memset(map, 0xff, tab->num_symbols * sizeof(u32));
+  u32 num_strings = 0;
+
+#define CACHE_MAP(id)                      \
+  do {                                     \
+    if (map[id] == SYMBOL_NONE) {          \
+      map[id] = num_strings;               \
+      strings[num_strings++] = id;         \
+    }                                      \
+  } while (0)
+
+  CACHE_MAP(e->lhs);
+  for (u64 i = 0; i < e->list.num_terms; ++i) {
+    struct term *t = &e->list.terms[i];
+    for (u8 j = 0; j < t->num_factors; ++j) {
+      CACHE_MAP(t->tensors[j]);
+      if (t->indices[j] != SYMBOL_NONE) {
+        CACHE_MAP(t->indices[j]);
+      }
+    }
+    for (u8 j = 0; j < t->num_sum_indices; ++j) {
+      CACHE_MAP(t->sum_indices[j]);
+    }
+  }
+
+#undef CACHE_MAP
+
+  output_write(out, CACHE_MAGIC, 4);
+  output_write(out, (const u8 *) &key->len, 4);
+  output_write(out, key->data, key->len);
+  output_write(out, (const u8 *) &map[e->lhs], 4);
+  output_write(out, (const u8 *) &num_strings, 4);
+  for (u32 i = 0; i < num_strings; ++i) {
+    u32 id = strings[i];
+    output_write(out, (const u8 *) &tab->lens[id], 4);
+    output_write(out, tab->strings[id], tab->lens[id]);
+  }
+
+  output_write(out, (const u8 *) &e->list.num_terms, 8);
+  for (u64 i = 0; i < e->list.num_terms; ++i) {
+    struct term t = e->list.terms[i];
+    for (u8 j = 0; j < t.num_factors; ++j) {
+      t.tensors[j] = map[t.tensors[j]];
+      t.indices[j] = t.indices[j] == SYMBOL_NONE ? SYMBOL_NONE : map[t.indices[j]];
+    }
+    for (u8 j = 0; j < t.num_sum_indices; ++j) {
+      t.sum_indices[j] = map[t.sum_indices[j]];
+    }
+    output_write(out, (const u8 *) &t, sizeof(struct term));
+  }
+
+  free(map);
+  free(strings);
+}
+
+/* Returns true and fills in e on a hit */
+static bool cache_load(struct cache *c, struct cache_key *key, struct symbol_table *tab, struct expansion *e) {
+  if (c->memory && cache_memory_load(c->memory, key, tab, e)) {
+    return true;
+  }
+  if (!c->dir || !cache_file_load(c, key, tab, e)) {
+    return false;
+  }
+
+  /* Promote, so other contexts sharing the memory layer don't go to disk */
+  if (c->memory) {
+    struct output out = {0};
+    output_open_memory(&out);
+    cache_encode(&out, key, tab, e);
+    cache_memory_store(c->memory, key->hash, out.data, out.len);
+  }
+  return true;
+}
+
+/* Failures only mean the entry isn't cached, the temporary is removed and the run goes on */
+static void cache_file_store(struct cache *c, struct cache_key *key, const u8 *data, u64 len) {
+  u8 path[4096];
+  u8 tmp_path[4096 + 48];
+  cache_entry_path(c, key, path, sizeof(path));
+  snprintf(tmp_path, sizeof(tmp_path), "%s.%d.%lx.tmp", path, getpid(), (unsigned long) pthread_self());
+
+  /*
+   * Written to a temporary and renamed so readers never see partial entries,
+   * the temporary is per thread since contexts may store the same entry at once
+   */
+  i32 fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1) {
+    return;
+  }
+
+  bool ok = true;
+  while (ok && len > 0) {
+    ssize_t n = write(fd, data, len);
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    ok = n > 0;
+    if (ok) {
+      data += n;
+      len  -= n;
+    }
+  }
+
+  if (close(fd) == -1 || !ok || rename(tmp_path, path) == -1) {
+    unlink(tmp_path);
+  }
+}
+
+static void cache_store(struct cache *c, struct cache_key *key, struct symbol_table *tab, struct expansion *e) {
+  struct output out = {0};
+  output_open_memory(&out);
+  cache_encode(&out, key, tab, e);
+
+  if (c->dir) {
+    cache_file_store(c, key, out.data, out.len);
+  }
+
+  if (c->memory) {
+    cache_memory_store(c->memory, key->hash, out.data, out.len);
+  } else {
+    output_free(&out);
+  }
+}
+
+struct cache_file {
+  struct timespec mtime;
+  u64 size;
+  u8 name[32];
+};
+
+static i32 cache_file_cmp(const void *a, const void *b) {
+  const struct cache_file *fa = a;
+  const struct cache_file *fb = b;
+  if (fa->mtime.tv_sec != fb->mtime.tv_sec) {
+    return fa->mtime.tv_sec < fb->mtime.tv_sec ? -1 : 1;
+  }
+  if (fa->mtime.tv_nsec != fb->mtime.tv_nsec) {
+    return fa->mtime.tv_nsec < fb->mtime.tv_nsec ? -1 : 1;
+  }
+  return 0;
+}
+
+/* Removes least recently used entries until the cache fits in max_size */
+static void cache_evict(struct cache *c) {
+  DIR *dir = opendir(c->dir);
+  if (!dir) {
+    return;
+  }
+
+  struct cache_file *files = NULL;
+  u64 num_files = 0;
+  u64 cap = 0;
+  u64 total_size = 0;
+
+  u8 path[4096];
+  struct dirent *ent;
+  while ((ent = readdir(dir))) {
+    u64 len = strlen(ent->d_name);
+    if (len < 4 || len >= sizeof(files->name) || strcmp(ent->d_name + len - 4, ".ptc") != 0) {
+      continue;
+    }
+
+    struct stat st;
+    snprintf(path, sizeof(path), "%s/%s", c->dir, ent->d_name);
+    if (stat(path, &st) == -1) {
+      continue;
+    }
+
+    if (num_files == cap) {
+      cap = cap ? 2*cap : 64;
+      files = realloc(files, cap * sizeof(struct cache_file));
+      if (!files) {
+        die("Failed to realloc - %s\n", strerror(errno));
+      }
+    }
+
+    struct cache_file *f = &files[num_files++];
+    f->mtime = st.st_mtim;
+    f->size  = st.st_size;
+    memcpy(f->name, ent->d_name, len+1);
+    total_size += st.st_size;
+  }
+  closedir(dir);
+
+  if (total_size > c->max_size) {
+    qsort(files, num_files, sizeof(struct cache_file), cache_file_cmp);
+    for (u64 i = 0; i < num_files && total_size > c->max_size; ++i) {
+      snprintf(path, sizeof(path), "%s/%s", c->dir, files[i].name);
+      if (unlink(path) != -1) {
+        total_size -= files[i].size;
+      }
+    }
+  }
+
+  free(files);
+}
@@ -0,0 +1,476 @@
+/*
+ * Numerical evaluation of scalar statements
+ *
+ * The right hand side of a statement is compiled to a stack bytecode with
+ * constant subexpressions folded at compile time. The interpreter then runs
+ * every instruction over a block of EVAL_BLOCK points at once, so dispatch
+ * is paid once per block and the inner loops are plain array loops the
+ * compiler turns into SIMD code.
+ */
+
+#define EVAL_BLOCK    256
+#define EVAL_MAX_VARS 32
+
+enum bc_op {
+  BC_CONST,
+  BC_VAR,
+  BC_NEG,
+  BC_ADD,
+  BC_SUB,
+  BC_MUL,
+  BC_DIV,
+  BC_POW,
+  BC_FACTORIAL,
+  BC_EXP,
+  BC_SQRT,
+};
+
+struct bc_instr {
+  u32 op;
+  u32 arg;
+};
+
+struct bytecode {
+  struct bc_instr *code;
+  u32 len;
+  u32 cap;
+
+  f64 *consts;
+  u32 num_consts;
+  u32 consts_cap;
+
+  /* Free variables, symbol ids in slot order */
+  u32 vars[EVAL_MAX_VARS];
+  u32 num_vars;
+
+  u32 max_stack;
+};
+
+static void bytecode_free(struct bytecode *bc) {
+  free(bc->code);
+  free(bc->consts);
+  memset(bc, 0, sizeof(struct bytecode));
+}
+
+static void bc_emit(struct bytecode *bc, enum bc_op op, u32 arg) {
+  if (bc->len == bc->cap) {
+    bc->cap = bc->cap ? 2*bc->cap : 64;
+    bc->code = realloc(bc->code, bc->cap * sizeof(struct bc_instr));
+    if (!bc->code) {
+      die("Failed to realloc - %s\n", strerror(errno));
+    }
+  }
+  bc->code[bc->len++] = (struct bc_instr) { .op = op, .arg = arg };
+}
+
+static void bc_emit_const(struct bytecode *bc, f64 value) {
+  if (bc->num_consts == bc->consts_cap) {
+    bc->consts_cap = bc->consts_cap ? 2*bc->consts_cap : 16;
+    bc->consts = realloc(bc->consts, bc->consts_cap * sizeof(f64));
+    if (!bc->consts) {
+      die("Failed to realloc - %s\n", strerror(errno));
+    }
+  }
+  bc->consts[bc->num_consts] = value;
+  bc_emit(bc, BC_CONST, bc->num_consts++);
+}
+
+static u32 bc_var_slot(struct bytecode *bc, u32 sym) {
+  for (u32 i = 0; i < bc->num_vars; ++i) {
+    if (bc->vars[i] == sym) {
+      return i;
+    }
+  }
+  xassert(bc->num_vars < EVAL_MAX_VARS, "more than %u free variables\n", EVAL_MAX_VARS);
+  bc->vars[bc->num_vars] = sym;
+  return bc->num_vars++;
+}
+
+static inline f64 eval_factorial(f64 x) {
+  return tgamma(x + 1.0);
+}
+
+static f64 fold(enum bc_op op, f64 a, f64 b) {
+  switch (op) {
+  case BC_NEG:       return -a;
+  case BC_ADD:       return a + b;
+  case BC_SUB:       return a - b;
+  case BC_MUL:       return a * b;
+  case BC_DIV:       return a / b;
+  case BC_POW:       return pow(a, b);
+  case BC_FACTORIAL: return eval_factorial(a);
+  case BC_EXP:       return exp(a);
+  case BC_SQRT:      return sqrt(a);
+  default:           return 0;
+  }
+}
+
+static void compile_error(struct ast_node *node, const u8 *what) {
+  if (node->loc.at) {
+    print_location(&node->loc, "here\n");
+  }
+  die("Cannot evaluate %s!\n", what);
+}
+
+static enum bc_op compile_op(struct ast_node *node) {
+  switch (node->type) {
+  case AST_UNARY_OP:
+    return BC_NEG;
+  case AST_POSTFIX:
+    return BC_FACTORIAL;
+  case AST_FUN:
+    return strcmp(node->name, "sqrt") == 0 ? BC_SQRT : BC_EXP;
+  case AST_BINARY_OP:
+    switch (node->name[0]) {
+    case '+': return BC_ADD;
+    case '-': return BC_SUB;
+    case '*': return BC_MUL;
+    case '/': return BC_DIV;
+    case '^': return BC_POW;
+    }
+    break;
+  default:
+    break;
+  }
+
+  compile_error(node, ast_node_names[node->type]);
+  return BC_ADD;
+}
+
+/*
+ * Post order walk with an explicit stack. Each node is visited twice, the
+ * second time (marked as expanded) its operands are already on the
+ * compile time stack, which tracks which entries are constants and where
+ * their code starts so they can be folded away.
+ */
+struct compile_entry {
+  bool is_const;
+  f64 value;
+  u32 code_start;
+};
+
+static void compile(struct bytecode *bc, struct ast_node *root, struct symbol_table *tab) {
+  xassert(root->type == AST_BINARY_OP && root->name[0] == '=', "compile, root is not a statement\n");
+  memset(bc, 0, sizeof(struct bytecode));
+
+  struct emit_stack work = {0};
+  emit_push(&work, (struct emit_item) { .node = root->children[1], .expanded = false });
+
+  struct compile_entry *values = NULL;
+  u32 num_values = 0;
+  u32 values_cap = 0;
+
+  while (work.len > 0) {
+    struct emit_item item = work.items[--work.len];
+    struct ast_node *node = item.node;
+
+    if (!item.expanded && (node->type == AST_UNARY_OP || node->type == AST_BINARY_OP ||
+                           node->type == AST_POSTFIX || node->type == AST_FUN)) {
+      emit_push(&work, (struct emit_item) { .node = node, .expanded = true });
+      u8 n = node->type == AST_BINARY_OP ? 2 : 1;
+      for (u8 i = n; i-- > 0;) {
+        emit_push(&work, (struct emit_item) { .node = node->children[i], .expanded = false });
+      }
+      continue;
+    }
+
+    if (num_values + 1 > values_cap) {
+      values_cap = values_cap ? 2*values_cap : 64;
+      values = realloc(values, values_cap * sizeof(struct compile_entry));
+      if (!values) {
+        die("Failed to realloc - %s\n", strerror(errno));
+      }
+    }
+
+    switch (node->type) {
+    case AST_CONSTANT:
+      values[num_values++] = (struct compile_entry) { .is_const = true, .value = node->constant.value, .code_start = bc->len };
+      bc_emit_const(bc, node->constant.value);
+      break;
+    case AST_VAR:
+      values[num_values++] = (struct compile_entry) { .is_const = false, .code_start = bc->len };
+      bc_emit(bc, BC_VAR, bc_var_slot(bc, symbol_intern_cstr(tab, node->name)));
+      break;
+    case AST_UNARY_OP:
+    case AST_BINARY_OP:
+    case AST_POSTFIX:
+    case AST_FUN: {
+      enum bc_op op = compile_op(node);
+      u8 n = node->type == AST_BINARY_OP ? 2 : 1;
+      struct compile_entry *a = &values[num_values - n];
+      struct compile_entry *b = &values[num_values - 1];
+
+      if (node->type == AST_UNARY_OP && node->name[0] == '+') {
+        /* Unary plus is a no-op */
+      } else if (a->is_const && b->is_const) {
+        /* Drop the operand pushes and the constants they referenced */
+        f64 value = fold(op, a->value, b->value);
+        bc->len = a->code_start;
+        bc->num_consts -= n;
+        num_values -= n;
+        values[num_values++] = (struct compile_entry) { .is_const = true, .value = value, .code_start = bc->len };
+        bc_emit_const(bc, value);
+      } else {
+        u32 code_start = a->code_start;
+        num_values -= n;
+        values[num_values++] = (struct compile_entry) { .is_const = false, .code_start = code_start };
+        bc_emit(bc, op, 0);
+      }
+    } break;
+    default:
+      compile_error(node, ast_node_names[node->type]);
+    }
+
+    if (num_values > bc->max_stack) {
+      bc->max_stack = num_values;
+    }
+  }
+
+  free(values);
+  free(work.items);
+}
+
+/*
+ * Evaluates bc at n points, vars[i] holds the n values of free variable
+ * slot i. The stack holds one block of lanes per entry.
+ */
+static void evaluate(struct bytecode *bc, f64 **vars, u64 n, f64 *out) {
+  f64 *stack = aligned_alloc(64, (bc->max_stack ? bc->max_stack : 1) * EVAL_BLOCK * sizeof(f64));
+  if (!stack) {
+    die("Failed to aligned_alloc - %s\n", strerror(errno));
+  }
+
+  for (u64 base = 0; base < n; base += EVAL_BLOCK) {
+    const u64 len = n - base < EVAL_BLOCK ? n - base : EVAL_BLOCK;
+    f64 *top = stack;
+
+    for (u32 pc = 0; pc < bc->len; ++pc) {
+      struct bc_instr instr = bc->code[pc];
+
+      if (instr.op == BC_CONST) {
+        f64 v = bc->consts[instr.arg];
+        for (u64 i = 0; i < len; ++i) top[i] = v;
+        top += EVAL_BLOCK;
+        continue;
+      } else if (instr.op == BC_VAR) {
+        memcpy(top, vars[instr.arg] + base, len * sizeof(f64));
+        top += EVAL_BLOCK;
+        continue;
+      }
+
+      /* Unary ops work in place on the top entry */
+      f64 *r = top - EVAL_BLOCK;
+      switch (instr.op) {
+      case BC_NEG:       for (u64 i = 0; i < len; ++i) r[i] = -r[i];                 continue;
+      case BC_FACTORIAL: for (u64 i = 0; i < len; ++i) r[i] = eval_factorial(r[i]);  continue;
+      case BC_EXP:       for (u64 i = 0; i < len; ++i) r[i] = exp(r[i]);             continue;
+      case BC_SQRT:      for (u64 i = 0; i < len; ++i) r[i] = sqrt(r[i]);            continue;
+      }
+
+      /* Binary ops pop b and overwrite a */
+      f64 *restrict a = top - 2*EVAL_BLOCK;
+      const f64 *restrict b = top - EVAL_BLOCK;
+      switch (instr.op) {
+      case BC_ADD: for (u64 i = 0; i < len; ++i) a[i] = a[i] + b[i];      break;
+      case BC_SUB: for (u64 i = 0; i < len; ++i) a[i] = a[i] - b[i];      break;
+      case BC_MUL: for (u64 i = 0; i < len; ++i) a[i] = a[i] * b[i];      break;
+      case BC_DIV: for (u64 i = 0; i < len; ++i) a[i] = a[i] / b[i];      break;
+      case BC_POW: for (u64 i = 0; i < len; ++i) a[i] = pow(a[i], b[i]);  break;
+      }
+      top -= EVAL_BLOCK;
+    }
+
+    memcpy(out + base, stack, len * sizeof(f64));
+  }
+
+  free(stack);
+}
+
+/* Values for the free variables, given as --sweep=x=start:end:n or --set=x=value */
+
+#define EVAL_MAX_PARAMS EVAL_MAX_VARS
+
+struct eval_param {
+  const u8 *name;
+  u32 name_len;
+  f64 start;
+  f64 end;
+  u64 n;
+};
+
+static void parse_eval_param(struct eval_param *param, const u8 *arg, bool sweep) {
+  const u8 *eq = strchr(arg, '=');
+  xassert(eq && eq > arg, "expected name=value, got %s\n", arg);
+
+  param->name     = arg;
+  param->name_len = eq - arg;
+
+  char *end;
+  param->start = strtod(eq+1, &end);
+  param->end   = param->start;
+  param->n     = 0;
+
+  if (sweep) {
+    xassert(*end == ':', "expected name=start:end:n, got %s\n", arg);
+    param->end = strtod(end+1, &end);
+    xassert(*end == ':', "expected name=start:end:n, got %s\n", arg);
+    param->n = strtoull(end+1, &end, 10);
+    xassert(param->n > 0, "sweep %s needs at least one point\n", arg);
+  }
+
+  xassert(*end == 0, "trailing characters in %s\n", arg);
+}
+
+static inline void output_f64(struct output *out, f64 value) {
+  u8 str[32];
+  i32 len = snprintf(str, sizeof(str), "%.17g", value);
+  output_write(out, str, len);
+}
+
+/*
+ * Raw output of --format=evalbin, in host byte order like terms.bin
+ *
+ *   u8  magic[4]                       "PTGE"
+ *   u32 num_columns                    parameters, then statements
+ *   u64 num_rows
+ *   u8  names[]                        num_columns NUL terminated names, padded to 8 bytes
+ *   f64 columns[num_columns][num_rows]
+ *
+ * Columns are the evaluated arrays as is, so nothing is formatted and a
+ * reader can mmap the file and use them in place.
+ */
+#define EVAL_BIN_MAGIC "PTGE"
+
+static void dump_eval_bin(struct output *out, struct ast_node **roots, u16 num_statements,
+                          struct eval_param *params, u32 num_params,
+                          f64 **param_values, f64 **results, u64 n) {
+  u32 num_columns = num_params + num_statements;
+  output_write(out, EVAL_BIN_MAGIC, 4);
+  output_write(out, (const u8 *) &num_columns, 4);
+  output_write(out, (const u8 *) &n, 8);
+
+  u64 names_size = 0;
+  for (u32 i = 0; i < num_params; ++i) {
+    output_write(out, params[i].name, params[i].name_len);
+    output_write(out, "", 1);
+    names_size += params[i].name_len + 1;
+  }
+  for (u16 s = 0; s < num_statements; ++s) {
+    const u8 *name = roots[s]->children[0]->name;
+    output_write(out, name, strlen(name) + 1);
+    names_size += strlen(name) + 1;
+  }
+  output_pad8(out, names_size);
+
+  for (u32 i = 0; i < num_params; ++i) {
+    output_write(out, (const u8 *) param_values[i], n * sizeof(f64));
+  }
+  for (u16 s = 0; s < num_statements; ++s) {
+    output_write(out, (const u8 *) results[s], n * sizeof(f64));
+  }
+}
+
+static void dump_eval_txt(struct output *out, struct ast_node **roots, u16 num_statements,
+                          struct eval_param *params, u32 num_params,
+                          f64 **param_values, f64 **results, u64 n) {
+  output_puts(out, "#");
+  for (u32 i = 0; i < num_params; ++i) {
+    output_puts(out, " ");
+    output_write(out, params[i].name, params[i].name_len);
+  }
+  for (u16 s = 0; s < num_statements; ++s) {
+    output_puts(out, " ");
+    output_puts(out, roots[s]->children[0]->name);
+  }
+  output_puts(out, "\n");
+
+  for (u64 j = 0; j < n; ++j) {
+    for (u32 i = 0; i < num_params; ++i) {
+      output_f64(out, param_values[i][j]);
+      output_puts(out, "\t");
+    }
+    for (u16 s = 0; s < num_statements; ++s) {
+      output_f64(out, results[s][j]);
+      output_puts(out, s+1 < num_statements ? "\t" : "\n");
+    }
+  }
+}
+
+/*
+ * Evaluates every statement over the points given by params and writes one
+ * tab separated row per point: the parameter values followed by the value
+ * of each statement, or the same values as raw columns if binary is set.
+ * Sweeps run in lockstep, so they must agree on n.
+ */
+static void dump_eval(struct ast_node **roots, u16 num_statements, struct symbol_table *tab,
+                      struct eval_param *params, u32 num_params, bool binary, const u8 *filepath) {
+  u64 n = 0;
+  for (u32 i = 0; i < num_params; ++i) {
+    if (params[i].n) {
+      xassert(n == 0 || n == params[i].n, "all sweeps must have the same number of points\n");
+      n = params[i].n;
+    }
+  }
+  if (n == 0) {
+    n = 1;
+  }
+
+  /* Materialize every parameter, sweeps are evenly spaced including both ends */
+  u32 param_syms[EVAL_MAX_PARAMS];
+  f64 *param_values[EVAL_MAX_PARAMS];
+  for (u32 i = 0; i < num_params; ++i) {
+    param_syms[i] = symbol_intern(tab, params[i].name, params[i].name_len);
+    param_values[i] = malloc(n * sizeof(f64));
+    if (!param_values[i]) {
+      die("Failed to malloc - %s\n", strerror(errno));
+    }
+    f64 step = n > 1 ? (params[i].end - params[i].start) / (n - 1) : 0;
+    for (u64 j = 0; j < n; ++j) {
+      param_values[i][j] = params[i].n ? params[i].start + j*step : params[i].start;
+    }
+  }
+
+  f64 *results[MAX_NUM_STATEMENTS];
+  for (u16 s = 0; s < num_statements; ++s) {
+    struct bytecode bc;
+    compile(&bc, roots[s], tab);
+
+    f64 *vars[EVAL_MAX_VARS];
+    for (u32 v = 0; v < bc.num_vars; ++v) {
+      vars[v] = NULL;
+      for (u32 i = 0; i < num_params; ++i) {
+        if (param_syms[i] == bc.vars[v]) {
+          vars[v] = param_values[i];
+        }
+      }
+      if (!vars[v]) {
+        die("No value for free variable %s, use --set or --sweep\n", tab->strings[bc.vars[v]]);
+      }
+    }
+
+    results[s] = malloc(n * sizeof(f64));
+    if (!results[s]) {
+      die("Failed to malloc - %s\n", strerror(errno));
+    }
+    evaluate(&bc, vars, n, results[s]);
+    bytecode_free(&bc);
+  }
+
+  struct output out;
+  output_open(&out, filepath);
+
+  if (binary) {
+    dump_eval_bin(&out, roots, num_statements, params, num_params, param_values, results, n);
+  } else {
+    dump_eval_txt(&out, roots, num_statements, params, num_params, param_values, results, n);
+  }
+
+  output_close(&out);
+
+  for (u32 i = 0; i < num_params; ++i) {
+    free(param_values[i]);
+  }
+  for (u16 s = 0; s < num_statements; ++s) {
+    free(results[s]);
+  }
+}
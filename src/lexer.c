@@ -72,23 +72,29 @@ struct token {
 #define TOKEN(t, l) \
   (struct token) { .type = t, .loc = l }
 
-#define MAX_NUM_TOKENS 1024
-
 struct token_buffer {
-  struct token tokens[MAX_NUM_TOKENS];
-  u16 num_tokens;
+  struct token *tokens;
+  u32 num_tokens;
+  u32 cap;
 };
 
 static void dump_token_buffer(struct token_buffer *tok_buf) {
-  for (u16 i = 0; i < tok_buf->num_tokens; ++i) {
+  for (u32 i = 0; i < tok_buf->num_tokens; ++i) {
     puts(token_names[tok_buf->tokens[i].type]);
   }
 }
 
-void print_location(struct location *loc, const u8 *fmt, ...) {
-  printf(CBEGIN FG_CYAN CEND);
-  u64 size = printf("  %s:%u | ", loc->file, loc->line);
-  printf(CBEGIN RESET CEND);
+static void print_location(struct location *loc, const u8 *fmt, ...) {
+  FILE *fd = diag_stream(stdout);
+  bool colors = !error_trap;
+
+  if (colors) {
+    fprintf(fd, CBEGIN FG_CYAN CEND);
+  }
+  u64 size = fprintf(fd, "  %s:%llu | ", loc->file, loc->line);
+  if (colors) {
+    fprintf(fd, CBEGIN RESET CEND);
+  }
 
   const u8 *begin = loc->at;
   while (*begin && *begin != '\n') {
@@ -100,39 +106,43 @@ void print_location(struct location *loc, const u8 *fmt, ...) {
 
   const u8 *end = begin;
   while (*(end) && *(end) != '\n') {
-    putchar(*end);
+    fputc(*end, fd);
     end++;
   }
   if (end > begin) {
     end--;
   }
 
-  putchar('\n');
+  fputc('\n', fd);
 
-  for (u8 i = 0; i < size + (loc->at - begin); ++i) {
-    putchar(' ');
+  for (u64 i = 0; i < size + (loc->at - begin); ++i) {
+    fputc(' ', fd);
   }
 
-  printf(CBEGIN FG_CYAN CEND);
+  if (colors) {
+    fprintf(fd, CBEGIN FG_CYAN CEND);
+  }
 
-  putchar('^');
+  fputc('^', fd);
 
   if (loc->len > 3) {
-    for (u8 i = 0; i < loc->len-2; ++i) {
-      putchar('-');
+    for (u64 i = 0; i < loc->len-2; ++i) {
+      fputc('-', fd);
     }
-    putchar('^');
+    fputc('^', fd);
   }
 
-  putchar(' ');
-  putchar(' ');
+  fputc(' ', fd);
+  fputc(' ', fd);
 
   va_list args;
   va_start(args, fmt);
-  vprintf(fmt, args);
+  vfprintf(fd, fmt, args);
   va_end(args);
 
-  printf(CBEGIN RESET CEND);
+  if (colors) {
+    fprintf(fd, CBEGIN RESET CEND);
+  }
 }
 
 static inline bool match_str(struct lexer *lex, const u8 *str) {
@@ -156,6 +166,18 @@ static void consume_until(struct lexer *lex, const u8 *str) {
   }
 }
 
+/* location.len is a u8, longer names and numbers would silently wrap */
+#define TOKEN_MAX_LEN 255
+
+static inline void lex_token_len(struct token *tok, const u8 *end) {
+  if (end - tok->loc.at > TOKEN_MAX_LEN) {
+    error("Token too long!\n");
+    print_location(&tok->loc, "at most %u characters allowed\n", TOKEN_MAX_LEN);
+    die("Cannot recover!\n");
+  }
+  tok->loc.len = end - tok->loc.at;
+}
+
 static void next_token(struct lexer *lex, struct token *tok) {
   /* Consume whitespace and newlines */
   while (*lex->loc.at && (isspace(*lex->loc.at) || *lex->loc.at == '\n' || *lex->loc.at == '#')) {
@@ -257,14 +279,17 @@ static void next_token(struct lexer *lex, struct token *tok) {
     return;
   } else if (strncmp(lex->loc.at, "sum", 3) == 0) {
     *tok = TOKEN(SUM, lex->loc);
+    tok->loc.len = 3;
     lex->loc.at += 3;
     return;
   } else if (strncmp(lex->loc.at, "exp", 3) == 0) {
     *tok = TOKEN(EXP, lex->loc);
+    tok->loc.len = 3;
     lex->loc.at += 3;
     return;
   } else if (strncmp(lex->loc.at, "sqrt", 4) == 0) {
     *tok = TOKEN(SQRT, lex->loc);
+    tok->loc.len = 4;
     lex->loc.at += 4;
     return;
   }
@@ -276,6 +301,7 @@ static void next_token(struct lexer *lex, struct token *tok) {
       lex->loc.at++;
     }
     *tok = TOKEN(NUMBER, begin);
+    lex_token_len(tok, lex->loc.at);
     return;
   }
 
@@ -286,7 +312,7 @@ static void next_token(struct lexer *lex, struct token *tok) {
       lex->loc.at++;
     }
     *tok = TOKEN(IDENTIFIER, begin);
-    tok->loc.len = lex->loc.at - begin.at;
+    lex_token_len(tok, lex->loc.at);
     return;
   }
 
@@ -299,6 +325,42 @@ static void next_token(struct lexer *lex, struct token *tok) {
   die("Doesn't know how to handle unknown tokens\n");
 }
 
+/*
+ * Splits the token buffer into statements without parsing. ASSIGN only
+ * appears in <statement>, so every statement starts at an IDENTIFIER
+ * followed by ASSIGN.
+ */
+
+#define MAX_NUM_STATEMENTS 256
+
+struct statement_range {
+  u32 first_tok;
+  u32 end_tok;
+};
+
+static u16 split_statements(struct token_buffer *tok_buf, struct statement_range *ranges) {
+  u16 num_statements = 0;
+  for (u32 i = 0; i+1 < tok_buf->num_tokens; ++i) {
+    if (tok_buf->tokens[i].type == IDENTIFIER && tok_buf->tokens[i+1].type == ASSIGN) {
+      xassert(num_statements < MAX_NUM_STATEMENTS, "too many statements!\n");
+      if (num_statements > 0) {
+        ranges[num_statements-1].end_tok = i;
+      }
+      ranges[num_statements++].first_tok = i;
+    }
+  }
+
+  if (num_statements == 0 || ranges[0].first_tok != 0) {
+    error("Expected a statement!\n");
+    print_location(&tok_buf->tokens[0].loc, "here\n");
+    die("Cannot recover!\n");
+  }
+
+  ranges[num_statements-1].end_tok = tok_buf->num_tokens-1;
+
+  return num_statements;
+}
+
 static void lex(struct token_buffer *tok_buf, const u8 *filepath, const u8 *buf, const u64 size) {
   struct lexer lex = {
     .loc = {
@@ -309,10 +371,22 @@ static void lex(struct token_buffer *tok_buf, const u8 *filepath, const u8 *buf,
     }
   };
 
+  /* Storage is kept around so buffers can be reused */
+  tok_buf->num_tokens = 0;
+
   struct token tok;
   do {
     next_token(&lex, &tok);
-    xassert(tok_buf->num_tokens < MAX_NUM_TOKENS-1, "token_buffer out of space!");
+    if (tok_buf->num_tokens == tok_buf->cap) {
+      STATS_ADD(bytes_allocated, (tok_buf->cap ? tok_buf->cap : 1024) * sizeof(struct token));
+      tok_buf->cap = tok_buf->cap ? 2*tok_buf->cap : 1024;
+      tok_buf->tokens = realloc(tok_buf->tokens, tok_buf->cap * sizeof(struct token));
+      if (!tok_buf->tokens) {
+        die("Failed to realloc - %s\n", strerror(errno));
+      }
+    }
     tok_buf->tokens[tok_buf->num_tokens++] = tok;
   } while (tok.type != END_OF_FILE);
+
+  STATS_ADD(tokens, tok_buf->num_tokens);
 }
@@ -0,0 +1,499 @@
+/*
+ * Everything except main, compiled as one translation unit. Including this
+ * file gives access to all internals, ptgen.c and bench.c do that, while
+ * ./lib.sh builds it on its own into libptgen with only the ptgen_*
+ * functions from libptgen.h exported.
+ */
+
+#include "inttypes.h"
+#include "ptbin.h"
+#include "libptgen.h"
+
+// libc
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <ctype.h>
+#include <stdbool.h>
+#include <math.h>
+#include <setjmp.h>
+
+// posix
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <pthread.h>
+
+#define CBEGIN "\033["
+#define CEND   "m"
+
+#define FG_BLACK      "30"
+#define BG_BLACK      "40"
+#define FG_RED        "31"
+#define BG_RED        "41"
+#define FG_GREEN      "32"
+#define BG_GREEN      "42"
+#define FG_YELLOW     "33"
+#define BG_YELLOW     "43"
+#define FG_BLUE       "34"
+#define BG_BLUE       "44"
+#define FG_MAGENTA    "35"
+#define BG_MAGENTA    "45"
+#define FG_CYAN       "36"
+#define BG_CYAN       "46"
+#define FG_WHITE      "37"
+#define BG_WHITE      "47"
+#define RESET         "0"
+#define BOLD_ON       "1"
+#define UNDERLINE_ON  "4"
+#define INVERSE_ON    "7"
+#define BOLD_OFF      "21"
+#define UNDERLINE_OFF "24"
+#define INVERSE_OFF   "27"
+
+#include "stats.c"
+
+/*
+ * Library entry points catch fatal errors instead of aborting. While a trap
+ * is set on the current thread die() writes its message to the trap's
+ * stream and longjmps back to the entry point, error() and print_location()
+ * write there as well, without colors.
+ */
+struct error_trap {
+  jmp_buf env;
+  FILE *stream;
+};
+
+static _Thread_local struct error_trap *error_trap;
+
+static inline FILE *diag_stream(FILE *fallback) {
+  return error_trap ? error_trap->stream : fallback;
+}
+
+static void error(const char *fmt, ...) {
+  FILE *fd = diag_stream(stderr);
+  if (!error_trap) {
+    fprintf(fd, CBEGIN FG_RED CEND);
+  }
+  fprintf(fd, "Error: ");
+  if (!error_trap) {
+    fprintf(fd, CBEGIN RESET CEND);
+  }
+
+  va_list args;
+  va_start(args, fmt);
+  vfprintf(fd, fmt, args);
+  va_end(args);
+}
+
+static void vdie(const char *fmt, va_list args) {
+  if (error_trap) {
+    fprintf(error_trap->stream, "Fatal: ");
+    vfprintf(error_trap->stream, fmt, args);
+    longjmp(error_trap->env, 1);
+  }
+
+  /* print_location() writes to stdout, which abort() doesn't flush */
+  fflush(stdout);
+  fprintf(stderr, CBEGIN FG_RED ";" BOLD_ON CEND);
+  fprintf(stderr, "Fatal: ");
+  fprintf(stderr, CBEGIN RESET CEND);
+  vfprintf(stderr, fmt, args);
+
+  abort();
+}
+
+static void die(const char *fmt, ...) {
+  va_list args;
+  va_start(args, fmt);
+  vdie(fmt, args);
+  va_end(args);
+}
+
+static void inline xassert(bool cond, const char *fmt, ...) {
+  if (!cond) {
+    va_list args;
+    va_start(args, fmt);
+    vdie(fmt, args);
+    va_end(args);
+  }
+}
+
+#include "output.c"
+#include "arena.c"
+#include "lexer.c"
+#include "ast.c"
+#include "parser.c"
+#include "symbols.c"
+#include "terms.c"
+#include "binary.c"
+#include "cache.c"
+#include "eval.c"
+
+
+/*
+ * Contexts
+ *
+ * The context_* functions make up the pipeline and die() on errors like
+ * the rest of ptgen, main uses them directly. The exported ptgen_*
+ * functions wrap them in an error trap.
+ */
+
+/* The expansion cache is evicted after this many stores from one context */
+#define CONTEXT_EVICT_INTERVAL 64
+
+/*
+ * Symbols are kept across inputs, so a context serving similar inputs
+ * stops interning new ones, until the table grows past this many
+ */
+#define CONTEXT_MAX_SYMBOLS (1 << 16)
+
+enum context_phase {
+  CONTEXT_EMPTY,
+  CONTEXT_LEXED,
+  CONTEXT_PARSED,
+  CONTEXT_EXPANDED,
+};
+
+struct ptgen_context {
+  enum context_phase phase;
+
+  /* Input, preceded by a NUL so print_location() can scan back from the first line */
+  u8 *input;
+  u64 input_cap;
+  const u8 *name;
+
+  /* Everything below is cleared by context_reset(), keeping its storage, except for tab */
+  struct arena arena;
+  struct token_buffer tok_buf;
+  struct statement_range ranges[MAX_NUM_STATEMENTS];
+  struct ast_node *roots[MAX_NUM_STATEMENTS];
+  struct expansion es[MAX_NUM_STATEMENTS];
+  u16 num_statements;
+  struct symbol_table tab;
+  struct output out;
+
+  struct cache cache;
+  struct cache_key key;
+  u32 stores_since_evict;
+
+  enum ptgen_error error;
+  struct error_trap trap;
+  char *diag;
+  size_t diag_size;
+};
+
+static void context_reset(struct ptgen_context *ctx) {
+  arena_reset(&ctx->arena);
+  ctx->tok_buf.num_tokens = 0;
+  for (u16 i = 0; i < ctx->num_statements; ++i) {
+    ctx->roots[i] = NULL;
+    ctx->es[i].list.num_terms = 0;
+  }
+  ctx->num_statements = 0;
+  if (ctx->tab.num_symbols > CONTEXT_MAX_SYMBOLS) {
+    symbol_table_clear(&ctx->tab);
+  }
+  output_open_memory(&ctx->out);
+  ctx->phase = CONTEXT_EMPTY;
+}
+
+/* Resets ctx and returns a NUL terminated buffer for size bytes of input */
+static u8 *context_input(struct ptgen_context *ctx, const u8 *name, u64 size) {
+  context_reset(ctx);
+
+  if (size + 2 > ctx->input_cap) {
+    ctx->input_cap = size + 2;
+    free(ctx->input);
+    ctx->input = malloc(ctx->input_cap);
+    if (!ctx->input) {
+      ctx->input_cap = 0;
+      die("Failed to malloc - %s\n", strerror(errno));
+    }
+  }
+
+  ctx->name = arena_strndup(&ctx->arena, name, strlen(name));
+  ctx->input[0] = 0;
+  ctx->input[size+1] = 0;
+  return ctx->input + 1;
+}
+
+static void context_lex(struct ptgen_context *ctx, u64 size) {
+  ctx->error = PTGEN_ERR_LEX;
+
+  STATS_BEGIN(STATS_LEX);
+  lex(&ctx->tok_buf, ctx->name, ctx->input + 1, size);
+  STATS_END(STATS_LEX);
+
+  STATS_BEGIN(STATS_SPLIT);
+  ctx->num_statements = split_statements(&ctx->tok_buf, ctx->ranges);
+  STATS_END(STATS_SPLIT);
+
+  ctx->phase = CONTEXT_LEXED;
+}
+
+static void context_parse(struct ptgen_context *ctx) {
+  if (ctx->phase >= CONTEXT_PARSED) {
+    return;
+  }
+  ctx->error = PTGEN_ERR_PARSE;
+
+  STATS_BEGIN(STATS_PARSE);
+  for (u16 i = 0; i < ctx->num_statements; ++i) {
+    if (!ctx->roots[i]) {
+      ctx->roots[i] = parse(&ctx->tok_buf, &ctx->ranges[i], &ctx->arena);
+    }
+  }
+  STATS_END(STATS_PARSE);
+
+  ctx->phase = CONTEXT_PARSED;
+}
+
+/* Statements are cached individually, a hit skips parsing and expansion */
+static void context_expand(struct ptgen_context *ctx) {
+  if (ctx->phase >= CONTEXT_EXPANDED) {
+    return;
+  }
+
+  for (u16 i = 0; i < ctx->num_statements; ++i) {
+    if (cache_enabled(&ctx->cache)) {
+      STATS_BEGIN(STATS_EXPAND);
+      cache_key_build(&ctx->key, &ctx->tok_buf, &ctx->ranges[i]);
+      bool hit = cache_load(&ctx->cache, &ctx->key, &ctx->tab, &ctx->es[i]);
+      STATS_END(STATS_EXPAND);
+      if (hit) {
+        STATS_ADD(cache_hits, 1);
+        continue;
+      }
+      STATS_ADD(cache_misses, 1);
+    }
+
+    if (!ctx->roots[i]) {
+      ctx->error = PTGEN_ERR_PARSE;
+      STATS_BEGIN(STATS_PARSE);
+      ctx->roots[i] = parse(&ctx->tok_buf, &ctx->ranges[i], &ctx->arena);
+      STATS_END(STATS_PARSE);
+    }
+
+    ctx->error = PTGEN_ERR_EXPAND;
+    STATS_BEGIN(STATS_EXPAND);
+    expand(&ctx->es[i], ctx->roots[i], &ctx->tab);
+    if (cache_enabled(&ctx->cache)) {
+      cache_store(&ctx->cache, &ctx->key, &ctx->tab, &ctx->es[i]);
+      ctx->stores_since_evict++;
+    }
+    STATS_END(STATS_EXPAND);
+  }
+
+  ctx->phase = CONTEXT_EXPANDED;
+}
+
+/* Runs whatever phases format needs that haven't run yet */
+static void context_emit(struct ptgen_context *ctx, enum ptgen_format format, struct output *out) {
+  switch (format) {
+  case PTGEN_FORMAT_DOT:
+    context_parse(ctx);
+    ctx->error = PTGEN_ERR_EMIT;
+    STATS_BEGIN(STATS_EMIT_DOT);
+    dump_ast_to_dot(ctx->roots, ctx->num_statements, out);
+    STATS_END(STATS_EMIT_DOT);
+    break;
+  case PTGEN_FORMAT_TEX:
+    context_parse(ctx);
+    ctx->error = PTGEN_ERR_EMIT;
+    STATS_BEGIN(STATS_EMIT_TEX);
+    dump_ast_to_tex(ctx->roots, ctx->num_statements, out);
+    STATS_END(STATS_EMIT_TEX);
+    break;
+  case PTGEN_FORMAT_BIN:
+    context_expand(ctx);
+    ctx->error = PTGEN_ERR_EMIT;
+    STATS_BEGIN(STATS_EMIT_BIN);
+    dump_terms_to_bin(ctx->es, ctx->num_statements, &ctx->tab, out);
+    STATS_END(STATS_EMIT_BIN);
+    break;
+  }
+}
+
+/* Library entry points */
+
+/*
+ * Sets the trap in the frame of the entry point itself, which has to stay
+ * live for the longjmp. A failure leaves ctx reset and returns the error
+ * of the phase that was running.
+ */
+#define CONTEXT_ENTER(ctx)                                    \
+  do {                                                        \
+    rewind((ctx)->trap.stream);                               \
+    error_trap = &(ctx)->trap;                                \
+    if (setjmp((ctx)->trap.env)) {                            \
+      error_trap = NULL;                                      \
+      fputc(0, (ctx)->trap.stream);                           \
+      fflush((ctx)->trap.stream);                             \
+      context_reset(ctx);                                     \
+      return (ctx)->error;                                    \
+    }                                                         \
+  } while (0)
+
+#define CONTEXT_LEAVE(ctx)                                    \
+  do {                                                        \
+    error_trap = NULL;                                        \
+    (ctx)->error = PTGEN_OK;                                  \
+  } while (0)
+
+/* Argument errors are found before anything runs and don't touch the input */
+static enum ptgen_error context_args_error(struct ptgen_context *ctx, const u8 *msg) {
+  rewind(ctx->trap.stream);
+  fputs(msg, ctx->trap.stream);
+  fputc(0, ctx->trap.stream);
+  fflush(ctx->trap.stream);
+  return ctx->error = PTGEN_ERR_ARGS;
+}
+
+struct ptgen_context *ptgen_context_new(const struct ptgen_options *options) {
+  struct ptgen_context *ctx = calloc(1, sizeof(struct ptgen_context));
+  if (!ctx) {
+    return NULL;
+  }
+
+  /* Rewound on every call, messages are NUL terminated explicitly since older, longer ones stay behind */
+  ctx->trap.stream = open_memstream(&ctx->diag, &ctx->diag_size);
+  if (!ctx->trap.stream) {
+    free(ctx);
+    return NULL;
+  }
+
+  ctx->cache.max_size = CACHE_DEFAULT_MAX_SIZE;
+  if (options && options->cache_dir) {
+    if (mkdir(options->cache_dir, 0755) == -1 && errno != EEXIST) {
+      ptgen_context_free(ctx);
+      return NULL;
+    }
+    ctx->cache.dir = strdup(options->cache_dir);
+    if (!ctx->cache.dir) {
+      ptgen_context_free(ctx);
+      return NULL;
+    }
+  }
+  if (options && options->cache_size) {
+    ctx->cache.max_size = options->cache_size;
+  }
+
+  return ctx;
+}
+
+void ptgen_context_free(struct ptgen_context *ctx) {
+  if (!ctx) {
+    return;
+  }
+
+  if (ctx->cache.dir && ctx->stores_since_evict > 0) {
+    cache_evict(&ctx->cache);
+  }
+
+  arena_free(&ctx->arena);
+  free(ctx->input);
+  free(ctx->tok_buf.tokens);
+  for (u16 i = 0; i < MAX_NUM_STATEMENTS; ++i) {
+    term_list_free(&ctx->es[i].list);
+  }
+  symbol_table_free(&ctx->tab);
+  output_free(&ctx->out);
+  free(ctx->key.data);
+  free((void *) ctx->cache.dir);
+  fclose(ctx->trap.stream);
+  free(ctx->diag);
+  free(ctx);
+}
+
+void ptgen_context_reset(struct ptgen_context *ctx) {
+  context_reset(ctx);
+  ctx->error = PTGEN_OK;
+}
+
+enum ptgen_error ptgen_lex(struct ptgen_context *ctx, const char *name, const char *buf, uint64_t size) {
+  if (!buf && size > 0) {
+    return context_args_error(ctx, "No input buffer\n");
+  }
+  CONTEXT_ENTER(ctx);
+  ctx->error = PTGEN_ERR_LEX;
+  u8 *input = context_input(ctx, name ? name : "<input>", size);
+  memcpy(input, buf, size);
+  context_lex(ctx, size);
+  CONTEXT_LEAVE(ctx);
+  return PTGEN_OK;
+}
+
+enum ptgen_error ptgen_parse(struct ptgen_context *ctx) {
+  if (ctx->phase == CONTEXT_EMPTY) {
+    return context_args_error(ctx, "Nothing to parse, call ptgen_lex first\n");
+  }
+  CONTEXT_ENTER(ctx);
+  context_parse(ctx);
+  CONTEXT_LEAVE(ctx);
+  return PTGEN_OK;
+}
+
+enum ptgen_error ptgen_expand(struct ptgen_context *ctx) {
+  if (ctx->phase == CONTEXT_EMPTY) {
+    return context_args_error(ctx, "Nothing to expand, call ptgen_lex first\n");
+  }
+  CONTEXT_ENTER(ctx);
+  context_expand(ctx);
+  if (ctx->cache.dir && ctx->stores_since_evict >= CONTEXT_EVICT_INTERVAL) {
+    cache_evict(&ctx->cache);
+    ctx->stores_since_evict = 0;
+  }
+  CONTEXT_LEAVE(ctx);
+  return PTGEN_OK;
+}
+
+enum ptgen_error ptgen_emit(struct ptgen_context *ctx, enum ptgen_format format, const uint8_t **data, uint64_t *size) {
+  if (ctx->phase == CONTEXT_EMPTY) {
+    return context_args_error(ctx, "Nothing to emit, call ptgen_lex first\n");
+  }
+  if (format > PTGEN_FORMAT_BIN) {
+    return context_args_error(ctx, "Unknown format\n");
+  }
+  if (format == PTGEN_FORMAT_BIN && ptgen_expand(ctx) != PTGEN_OK) {
+    return ctx->error;
+  }
+  CONTEXT_ENTER(ctx);
+  output_open_memory(&ctx->out);
+  context_emit(ctx, format, &ctx->out);
+  CONTEXT_LEAVE(ctx);
+  *data = ctx->out.data;
+  *size = ctx->out.len;
+  return PTGEN_OK;
+}
+
+uint32_t ptgen_num_statements(struct ptgen_context *ctx) {
+  return ctx->num_statements;
+}
+
+const char *ptgen_error_message(struct ptgen_context *ctx) {
+  if (ctx->error == PTGEN_OK || !ctx->diag) {
+    return "";
+  }
+  return ctx->diag;
+}
+
+const char *ptgen_error_string(enum ptgen_error err) {
+  switch (err) {
+  case PTGEN_OK:         return "ok";
+  case PTGEN_ERR_ARGS:   return "invalid arguments";
+  case PTGEN_ERR_LEX:    return "lex error";
+  case PTGEN_ERR_PARSE:  return "parse error";
+  case PTGEN_ERR_EXPAND: return "expand error";
+  case PTGEN_ERR_EMIT:   return "emit error";
+  case PTGEN_ERR_IO:     return "io error";
+  }
+  return "unknown error";
+}
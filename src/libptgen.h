@@ -0,0 +1,72 @@
+#pragma once
+
+/*
+ * libptgen, ptgen as a library
+ *
+ * Build with ./lib.sh, which produces libptgen.a and libptgen.so from
+ * src/libptgen.c. All state lives in a struct ptgen_context, so any number
+ * of contexts can be used concurrently from different threads as long as
+ * each one is only used by one thread at a time.
+ *
+ *   struct ptgen_context *ctx = ptgen_context_new(NULL);
+ *   for (...) {
+ *     if (ptgen_lex(ctx, "<input>", buf, size) != PTGEN_OK ||
+ *         ptgen_emit(ctx, PTGEN_FORMAT_BIN, &data, &size) != PTGEN_OK) {
+ *       fprintf(stderr, "%s", ptgen_error_message(ctx));
+ *     }
+ *   }
+ *   ptgen_context_free(ctx);
+ *
+ * Lexing an input resets the context, the phases after it (parse, expand)
+ * run on demand when something needs them. Errors never abort, every entry
+ * point returns a ptgen_error and the diagnostics are kept in the context
+ * until its next call.
+ */
+
+#include <stdint.h>
+
+enum ptgen_error {
+  PTGEN_OK = 0,
+  PTGEN_ERR_ARGS,
+  PTGEN_ERR_LEX,
+  PTGEN_ERR_PARSE,
+  PTGEN_ERR_EXPAND,
+  PTGEN_ERR_EMIT,
+  PTGEN_ERR_IO,
+};
+
+enum ptgen_format {
+  PTGEN_FORMAT_DOT,
+  PTGEN_FORMAT_TEX,
+  PTGEN_FORMAT_BIN,
+};
+
+struct ptgen_options {
+  /* Directory of the expansion cache, NULL disables it */
+  const char *cache_dir;
+  /* Size the cache is evicted down to, 0 picks the default */
+  uint64_t cache_size;
+};
+
+struct ptgen_context;
+
+/* options may be NULL, returns NULL if out of memory */
+struct ptgen_context *ptgen_context_new(const struct ptgen_options *options);
+void ptgen_context_free(struct ptgen_context *ctx);
+
+/* Drops the current input, all storage is kept for the next one */
+void ptgen_context_reset(struct ptgen_context *ctx);
+
+/* Resets ctx and lexes a copy of buf, name is only used in diagnostics */
+enum ptgen_error ptgen_lex(struct ptgen_context *ctx, const char *name, const char *buf, uint64_t size);
+enum ptgen_error ptgen_parse(struct ptgen_context *ctx);
+enum ptgen_error ptgen_expand(struct ptgen_context *ctx);
+
+/* data stays valid until the next call on ctx */
+enum ptgen_error ptgen_emit(struct ptgen_context *ctx, enum ptgen_format format, const uint8_t **data, uint64_t *size);
+
+uint32_t ptgen_num_statements(struct ptgen_context *ctx);
+
+/* Diagnostics of the last failed call, empty if it succeeded */
+const char *ptgen_error_message(struct ptgen_context *ctx);
+const char *ptgen_error_string(enum ptgen_error err);
@@ -0,0 +1,126 @@
+/*
+ * Buffered output used by the emitters. Everything is formatted into one
+ * large user-space buffer which is handed to the kernel with write/writev
+ * once it fills up, instead of going through stdio for every fragment.
+ *
+ * Memory outputs (fd == -1) grow instead of flushing and keep their buffer
+ * across output_open_memory() calls, the data is released by output_free().
+ */
+
+#define OUTPUT_BUFFER_SIZE (1 << 20)
+
+struct output {
+  i32 fd;
+  u8 *data;
+  u64 len;
+  u64 cap;
+};
+
+static void write_all(i32 fd, const u8 *data, u64 len) {
+  while (len > 0) {
+    ssize_t n = write(fd, data, len);
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    xassert(n != -1, "(write) %s\n", strerror(errno));
+    data += n;
+    len  -= n;
+  }
+}
+
+static void output_open(struct output *out, const u8 *filepath) {
+  out->fd = open(filepath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  xassert(out->fd != -1, "(open) %s\n", strerror(errno));
+
+  out->data = malloc(OUTPUT_BUFFER_SIZE);
+  if (!out->data) {
+    die("Failed to malloc - %s\n", strerror(errno));
+  }
+  out->len = 0;
+  out->cap = OUTPUT_BUFFER_SIZE;
+}
+
+static void output_open_memory(struct output *out) {
+  out->fd  = -1;
+  out->len = 0;
+}
+
+static void output_free(struct output *out) {
+  free(out->data);
+  memset(out, 0, sizeof(struct output));
+}
+
+static void output_flush(struct output *out) {
+  if (out->fd == -1) {
+    return;
+  }
+  write_all(out->fd, out->data, out->len);
+  out->len = 0;
+}
+
+static void output_close(struct output *out) {
+  if (out->fd == -1) {
+    return;
+  }
+  output_flush(out);
+  close(out->fd);
+  free(out->data);
+}
+
+/* Appends len bytes, strings that don't fit go out in the same writev as the buffer */
+static void output_write(struct output *out, const u8 *str, u64 len) {
+  if (out->len + len > out->cap && out->fd == -1) {
+    while (out->len + len > out->cap) {
+      out->cap = out->cap ? 2*out->cap : 4096;
+    }
+    out->data = realloc(out->data, out->cap);
+    if (!out->data) {
+      die("Failed to realloc - %s\n", strerror(errno));
+    }
+  }
+
+  if (out->len + len <= out->cap) {
+    memcpy(out->data + out->len, str, len);
+    out->len += len;
+    return;
+  }
+
+  struct iovec iov[2] = {
+    { .iov_base = out->data,  .iov_len = out->len },
+    { .iov_base = (void *)str, .iov_len = len },
+  };
+
+  u64 total = out->len + len;
+  ssize_t n = writev(out->fd, iov, 2);
+  xassert(n != -1 || errno == EINTR, "(writev) %s\n", strerror(errno));
+  if (n == -1) {
+    n = 0;
+  }
+
+  /* Finish off whatever a short writev left behind */
+  if (n < out->len) {
+    write_all(out->fd, out->data + n, out->len - n);
+    write_all(out->fd, str, len);
+  } else if (n < total) {
+    write_all(out->fd, str + (n - out->len), total - n);
+  }
+
+  out->len = 0;
+}
+
+static inline void output_puts(struct output *out, const u8 *str) {
+  if (str) {
+    output_write(out, str, strlen(str));
+  }
+}
+
+static inline void output_u64(struct output *out, u64 value) {
+  u8 digits[20];
+  u8 i = sizeof(digits);
+  do {
+    digits[--i] = '0' + value % 10;
+    value /= 10;
+  } while (value);
+
+  output_write(out, digits + i, sizeof(digits) - i);
+}
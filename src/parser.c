@@ -1,33 +1,40 @@
 /*
  * complete parser syntax:
- *   <program> ::= <statement>
+ *   <program> ::= { <statement> }
  *
  *   <statement> ::= <id> <assignment-op> <add-exp>
  *
  *   <add-exp> ::= <mul-exp> { ("+" | "-") <mul-exp> }
  *
- *   <mul-exp>  ::= <pow-exp> {("*" | "/") <pow-exp>}
+ *   <mul-exp>  ::= <unary-exp> {("*" | "/") <unary-exp>}
  *
- *   <pow-exp> ::= <unary-exp> { "^" <unary-exp> }
+ *   <unary-exp>  ::= <pow-exp> | ("-" | "+") <unary-exp>
  *
- *   <unary-exp>  ::= <postfix-exp> | ("-" | "+") <unary-exp>
+ *   <pow-exp> ::= <postfix-exp> [ "^" <unary-exp> ]
  *
  *   <postfix-exp> ::= <primary-exp> | <primary-exp> "!"
  *
  *   <primary-exp> ::= "(" <add-exp> ")" | <constant> | <call-exp> | <sum-exp> | <id>
  *
+ *   <call-exp> ::= ("EXP" | "SQRT") "(" <add-exp> ")"
+ *
  *   <sum-exp> ::= "SUM" "(" <id-list-exp> ")" "{" <add-exp> "}"
  *
  *   <id-list-exp> ::= <id> { "," <id> }
- *
- *   <call-exp> ::= <id> "(" <param-exp> ")"
- *
- *   <param-exp> ::= <add-exp> { "," <add-exp> }
  */
 
+/*
+ * Every recursive path through the grammar passes through <unary-exp>, so
+ * bounding its nesting bounds the stack usage of the parser, and of the
+ * recursive passes over the tree after it, for any input.
+ */
+#define PARSER_MAX_DEPTH 256
+
 struct parser {
   struct token_buffer *tok_buf;
-  u16 curr_tok;
+  struct arena *arena;
+  u32 curr_tok;
+  u32 depth;
 };
 
 static inline struct token *peek_token(struct parser *p) {
@@ -70,15 +77,15 @@ static bool match(struct parser *p, enum token_type tok) {
 static struct ast_node *parse_add(struct parser *p);
 
 static struct ast_node *parse_reserved_function(struct parser *p) {
-  struct token *tok_id = expect(p, IDENTIFIER);
+  struct token *tok_id = pop_token(p);
   expect(p, LPAREN);
   struct ast_node *node_add = parse_add(p);
-  expect(p, LPAREN);
+  expect(p, RPAREN);
 
-  struct ast_node *node_fun = ast_node_new();
+  struct ast_node *node_fun = ast_node_new(p->arena);
   node_fun->type = AST_FUN;
   node_fun->loc  = tok_id->loc;
-  node_fun->name = xstrndup(tok_id->loc.at, tok_id->loc.len);
+  node_fun->name = arena_strndup(p->arena, tok_id->loc.at, tok_id->loc.len);
   node_fun->children[0] = node_add;
 
   return node_fun;
@@ -87,15 +94,15 @@ static struct ast_node *parse_reserved_function(struct parser *p) {
 static struct ast_node *parse_iden(struct parser *p) {
   struct token *tok = expect(p, IDENTIFIER);
 
-  struct ast_node *node_var = ast_node_new();
+  struct ast_node *node_var = ast_node_new(p->arena);
   node_var->type = AST_VAR;
   node_var->loc  = tok->loc;
-  node_var->name = xstrndup(tok->loc.at, tok->loc.len);
+  node_var->name = arena_strndup(p->arena, tok->loc.at, tok->loc.len);
 
   return node_var;
 }
 
-/* <primary-exp> ::= "(" <add-exp> ")" | <constant> | <id> | SUM(<id>,<id>,<id>,<id>){ <add-exp> } */
+/* <primary-exp> ::= "(" <add-exp> ")" | <constant> | <id> | SUM(<id>{,<id>}){ <add-exp> } */
 static struct ast_node *parse_primary(struct parser *p) {
   struct token *tok = peek_token(p);
 
@@ -106,49 +113,52 @@ static struct ast_node *parse_primary(struct parser *p) {
     return node_add;
   } else if (tok->type == NUMBER) {
     pop_token(p);
-    struct ast_node *node_constant = ast_node_new();
+    struct ast_node *node_constant = ast_node_new(p->arena);
     node_constant->type = AST_CONSTANT;
     node_constant->loc  = tok->loc;
-    node_constant->name = xstrndup(tok->loc.at, tok->loc.len);
+    node_constant->name = arena_strndup(p->arena, tok->loc.at, tok->loc.len);
     node_constant->constant.value = strtoull(tok->loc.at, NULL, 10);
     return node_constant;
   } else if (tok->type == IDENTIFIER) {
     struct ast_node *node_iden = parse_iden(p);
     return node_iden;
+  } else if (tok->type == EXP || tok->type == SQRT) {
+    return parse_reserved_function(p);
   } else if (tok->type == SUM) {
     pop_token(p);
-    struct ast_node *node_sum = ast_node_new();
+    struct ast_node *node_sum = ast_node_new(p->arena);
     node_sum->type = AST_SUM;
     node_sum->loc  = tok->loc;
-    node_sum->name = xstrndup(tok->loc.at, tok->loc.len);
+    node_sum->name = arena_strndup(p->arena, tok->loc.at, tok->loc.len);
 
+    /* Indices go first, the summand is always the last child */
     expect(p, LPAREN);
-    struct ast_node *node_id0 = parse_iden(p);
-    expect(p, COMMA);
-    struct ast_node *node_id1 = parse_iden(p);
-    expect(p, COMMA);
-    struct ast_node *node_id2 = parse_iden(p);
-    expect(p, COMMA);
-    struct ast_node *node_id3 = parse_iden(p);
+    u8 num_ids = 0;
+    node_sum->children[num_ids++] = parse_iden(p);
+    while (match(p, COMMA)) {
+      struct token *tok_comma = pop_token(p);
+      if (num_ids == AST_NODE_MAX_CHILDREN-1) {
+        error("Too many summation indices!\n");
+        print_location(&tok_comma->loc, "at most %u allowed\n", AST_NODE_MAX_CHILDREN-1);
+        die("Cannot recover!\n");
+      }
+      node_sum->children[num_ids++] = parse_iden(p);
+    }
     expect(p, RPAREN);
 
     expect(p, LBRACE);
     struct ast_node *node_add = parse_add(p);
     expect(p, RBRACE);
 
-    node_sum->children[0] = node_id0;
-    node_sum->children[1] = node_id1;
-    node_sum->children[2] = node_id2;
-    node_sum->children[3] = node_id3;
-    node_sum->children[4] = node_add;
+    node_sum->children[num_ids] = node_add;
 
     return node_sum;
   } else if (tok->type == CREATE_OP) {
     pop_token(p);
-    struct ast_node *node_create_op = ast_node_new();
+    struct ast_node *node_create_op = ast_node_new(p->arena);
     node_create_op->type = AST_CREATE_OP;
     node_create_op->loc  = tok->loc;
-    node_create_op->name = xstrndup(tok->loc.at, tok->loc.len);
+    node_create_op->name = arena_strndup(p->arena, tok->loc.at, tok->loc.len);
 
     expect(p, LPAREN);
     struct ast_node *node_id = parse_iden(p);
@@ -159,10 +169,10 @@ static struct ast_node *parse_primary(struct parser *p) {
     return node_create_op;
   } else if (tok->type == ANNIHI_OP) {
     pop_token(p);
-    struct ast_node *node_annihi_op = ast_node_new();
+    struct ast_node *node_annihi_op = ast_node_new(p->arena);
     node_annihi_op->type = AST_ANNIHI_OP;
     node_annihi_op->loc  = tok->loc;
-    node_annihi_op->name = xstrndup(tok->loc.at, tok->loc.len);
+    node_annihi_op->name = arena_strndup(p->arena, tok->loc.at, tok->loc.len);
 
     expect(p, LPAREN);
     struct ast_node *node_id = parse_iden(p);
@@ -184,12 +194,12 @@ static struct ast_node *parse_postfix(struct parser *p) {
 
   /* TODO: we only support a single "!" */
 
-  if (match(p, POW)) {
+  if (match(p, FACTORIAL)) {
     struct token *tok_op = pop_token(p);
-    struct ast_node *node_postfix = ast_node_new();
+    struct ast_node *node_postfix = ast_node_new(p->arena);
     node_postfix->type = AST_POSTFIX;
     node_postfix->loc = tok_op->loc;
-    node_postfix->name = xstrndup(tok_op->loc.at, tok_op->loc.len);
+    node_postfix->name = arena_strndup(p->arena, tok_op->loc.at, tok_op->loc.len);
     node_postfix->children[0] = node_primary;
     return node_postfix;
   } else {
@@ -197,19 +207,31 @@ static struct ast_node *parse_postfix(struct parser *p) {
   }
 }
 
-/* <unary-exp>  ::= <postfix-exp> | ("-" | "+") <unary-exp> */
+static struct ast_node *parse_pow(struct parser *p);
+
+/* <unary-exp>  ::= <pow-exp> | ("-" | "+") <unary-exp> */
 static struct ast_node *parse_unary(struct parser *p) {
+  if (++p->depth > PARSER_MAX_DEPTH) {
+    error("Expression nested too deeply!\n");
+    print_location(&peek_token(p)->loc, "at most %u levels allowed\n", PARSER_MAX_DEPTH);
+    die("Cannot recover!\n");
+  }
+
+  struct ast_node *node;
   if (match_either(p, (enum token_type[]){ADD,SUB}, 2)) {
     struct token *tok_op = pop_token(p);
-    struct ast_node *node_unary = parse_unary(p);
-    node_unary->type = AST_UNARY_OP;
-    node_unary->loc = tok_op->loc;
-    node_unary->name = xstrndup(tok_op->loc.at, tok_op->loc.len);
-    node_unary->children[0] = node_unary;
-    return node_unary;
+    struct ast_node *node_operand = parse_unary(p);
+    node = ast_node_new(p->arena);
+    node->type = AST_UNARY_OP;
+    node->loc = tok_op->loc;
+    node->name = arena_strndup(p->arena, tok_op->loc.at, tok_op->loc.len);
+    node->children[0] = node_operand;
   } else {
-    return parse_postfix(p);
+    node = parse_pow(p);
   }
+
+  --p->depth;
+  return node;
 }
 
 
@@ -222,9 +244,9 @@ static struct ast_node *parse_binary_op(struct parser *p, parse_func* pf, enum t
     struct token *tok_op = pop_token(p);
     e2 = pf(p);
 
-    node_op = ast_node_new();
+    node_op = ast_node_new(p->arena);
     node_op->type = AST_BINARY_OP;
-    node_op->name = xstrndup(tok_op->loc.at, tok_op->loc.len);
+    node_op->name = arena_strndup(p->arena, tok_op->loc.at, tok_op->loc.len);
     node_op->children[0] = e1;
     node_op->children[1] = e2;
     e1 = node_op;
@@ -233,14 +255,32 @@ static struct ast_node *parse_binary_op(struct parser *p, parse_func* pf, enum t
   return e1;
 }
 
-/* <pow-exp> ::= <unary-exp> { "^" <unary-exp> } */
+/*
+ * <pow-exp> ::= <postfix-exp> [ "^" <unary-exp> ]
+ *
+ * Right associative and binds tighter than unary minus on its left, so
+ * 2^3^2 is 2^(3^2) and -x^2 is -(x^2), while the exponent may carry its
+ * own sign as in x^-1.
+ */
 static struct ast_node *parse_pow(struct parser *p) {
-  return parse_binary_op(p, parse_unary, (enum token_type[]){POW}, 2);
+  struct ast_node *node_base = parse_postfix(p);
+  if (!match(p, POW)) {
+    return node_base;
+  }
+
+  struct token *tok_op = pop_token(p);
+  struct ast_node *node_exp = parse_unary(p);
+  struct ast_node *node_op = ast_node_new(p->arena);
+  node_op->type = AST_BINARY_OP;
+  node_op->name = arena_strndup(p->arena, tok_op->loc.at, tok_op->loc.len);
+  node_op->children[0] = node_base;
+  node_op->children[1] = node_exp;
+  return node_op;
 }
 
-/* <mul-exp>  ::= <pow-exp> {("*" | "/") <pow-exp>} */
+/* <mul-exp>  ::= <unary-exp> {("*" | "/") <unary-exp>} */
 static struct ast_node *parse_mul(struct parser *p) {
-  return parse_binary_op(p, parse_pow, (enum token_type[]){MUL, DIV}, 2);
+  return parse_binary_op(p, parse_unary, (enum token_type[]){MUL, DIV}, 2);
 }
 
 /* <add-exp> ::= <mul-exp> { ("+" | "-") <mul-exp> } */
@@ -253,26 +293,37 @@ static struct ast_node *parse_statement(struct parser *p) {
   struct token *tok_id  = expect(p, IDENTIFIER);
   struct token *tok_asn = expect(p, ASSIGN);
   struct ast_node *node_add = parse_add(p);
-  struct ast_node *node_var = ast_node_new();
+  struct ast_node *node_var = ast_node_new(p->arena);
   node_var->type = AST_VAR;
   node_var->loc = tok_id->loc;
-  node_var->name = xstrndup(tok_id->loc.at, tok_id->loc.len);
+  node_var->name = arena_strndup(p->arena, tok_id->loc.at, tok_id->loc.len);
 
-  struct ast_node *node_asn = ast_node_new();
+  struct ast_node *node_asn = ast_node_new(p->arena);
   node_asn->type = AST_BINARY_OP;
   node_asn->loc = tok_asn->loc;
-  node_asn->name = xstrndup(tok_asn->loc.at, tok_asn->loc.len);
+  node_asn->name = arena_strndup(p->arena, tok_asn->loc.at, tok_asn->loc.len);
   node_asn->children[0] = node_var;
   node_asn->children[1] = node_add;
 
   return node_asn;
 }
 
-static struct ast_node *parse(struct token_buffer *tok_buf) {
+/* Parses a single statement found by split_statements() */
+static struct ast_node *parse(struct token_buffer *tok_buf, struct statement_range *range, struct arena *arena) {
   struct parser p = {
     .tok_buf = tok_buf,
-    .curr_tok = 0,
+    .arena = arena,
+    .curr_tok = range->first_tok,
   };
 
-  return parse_statement(&p);
+  struct ast_node *root = parse_statement(&p);
+  if (p.curr_tok != range->end_tok) {
+    error("Unexpected token after statement!\n");
+    print_location(&peek_token(&p)->loc, "here\n");
+    die("Cannot recover!\n");
+  }
+
+  STATS_CALL(stats_count_nodes(root));
+
+  return root;
 }
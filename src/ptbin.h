@@ -0,0 +1,250 @@
+#pragma once
+
+/*
+ * ptgen binary term format, version 2
+ *
+ * Written by `ptgen --format=bin`, meant to be mmap'd and read in place.
+ * All integers are little endian and every section is 8 byte aligned.
+ * Both the writer and the reader use the host byte order, so building on a
+ * big endian host is rejected below.
+ *
+ *   struct ptbin_header
+ *   uint32_t string_offsets[num_strings+1]             offset index into string data
+ *   uint8_t  string_data[]                             NUL terminated strings
+ *   struct ptbin_statement statements[num_statements]
+ *   struct ptbin_term terms[num_terms]                 fixed width term records
+ *
+ * A term reads as
+ *
+ *   coeff * sum_{sum_indices} tensors[0]_{indices[0]} tensors[1]_{indices[1]} ...
+ *
+ * where tensors, indices and sum_indices are ids into the string table and
+ * PTBIN_NONE marks a factor without an index. Each statement owns the
+ * contiguous run of terms [first_term, first_term + num_terms).
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "ptbin is little endian and is read and written in host byte order"
+#endif
+
+#define PTBIN_MAGIC   "PTGB"
+#define PTBIN_VERSION 2
+#define PTBIN_NONE    0xffffffff
+
+#define PTBIN_MAX_FACTORS     16
+#define PTBIN_MAX_SUM_INDICES 8
+
+struct ptbin_header {
+  uint8_t  magic[4];
+  uint32_t version;
+  uint32_t num_strings;
+  uint32_t num_statements;
+  uint64_t num_terms;
+  uint64_t string_offsets_offset;
+  uint64_t string_data_offset;
+  uint64_t statements_offset;
+  uint64_t terms_offset;
+  uint64_t file_size;
+};
+
+struct ptbin_statement {
+  uint32_t lhs;
+  uint32_t reserved;
+  uint64_t first_term;
+  uint64_t num_terms;
+};
+
+struct ptbin_term {
+  int64_t coeff;
+  uint32_t num_factors;
+  uint32_t num_sum_indices;
+  uint32_t tensors[PTBIN_MAX_FACTORS];
+  uint32_t indices[PTBIN_MAX_FACTORS];
+  uint32_t sum_indices[PTBIN_MAX_SUM_INDICES];
+};
+
+_Static_assert(sizeof(struct ptbin_header) == 64, "ptbin_header layout");
+_Static_assert(sizeof(struct ptbin_statement) == 24, "ptbin_statement layout");
+_Static_assert(sizeof(struct ptbin_term) == 176, "ptbin_term layout");
+
+/* Reader */
+
+enum ptbin_error {
+  PTBIN_OK = 0,
+  PTBIN_ERR_IO,
+  PTBIN_ERR_MAGIC,
+  PTBIN_ERR_VERSION,
+  PTBIN_ERR_CORRUPT,
+};
+
+struct ptbin {
+  const uint8_t *data;
+  uint64_t size;
+  const struct ptbin_header *header;
+  const uint32_t *string_offsets;
+  const uint8_t *string_data;
+  const struct ptbin_statement *statements;
+  const struct ptbin_term *terms;
+};
+
+/*
+ * Returns the end of a section of count elements at offset, or 0 if it
+ * isn't 8 byte aligned or doesn't fit between start and size. Written to
+ * not overflow on any header contents.
+ */
+static inline uint64_t ptbin_section_end(uint64_t offset, uint64_t count, uint64_t elem_size, uint64_t start, uint64_t size) {
+  if (offset % 8 != 0 || offset < start || offset > size || count > (size - offset) / elem_size) {
+    return 0;
+  }
+  return offset + count * elem_size;
+}
+
+/*
+ * Validates a file already in memory, nothing is copied. Every offset, id
+ * range and count the accessors below rely on is checked, so a corrupt
+ * file is rejected instead of leading to out of bounds reads. data has to
+ * be 8 byte aligned, which mmap'd files always are.
+ */
+static inline enum ptbin_error ptbin_from_memory(struct ptbin *bin, const uint8_t *data, uint64_t size) {
+  memset(bin, 0, sizeof(struct ptbin));
+  if (size < sizeof(struct ptbin_header) || (uint64_t)(uintptr_t) data % 8 != 0) {
+    return PTBIN_ERR_CORRUPT;
+  }
+
+  const struct ptbin_header *h = (const struct ptbin_header *) data;
+  if (memcmp(h->magic, PTBIN_MAGIC, 4) != 0) {
+    return PTBIN_ERR_MAGIC;
+  }
+  if (h->version != PTBIN_VERSION) {
+    return PTBIN_ERR_VERSION;
+  }
+  if (h->file_size != size) {
+    return PTBIN_ERR_CORRUPT;
+  }
+
+  /* Sections follow each other in file order without overlapping */
+  uint64_t offsets_end = ptbin_section_end(h->string_offsets_offset, (uint64_t)h->num_strings+1, 4,
+                                      sizeof(struct ptbin_header), size);
+  if (!offsets_end || h->string_data_offset % 8 != 0 ||
+      h->string_data_offset < offsets_end || h->string_data_offset > size) {
+    return PTBIN_ERR_CORRUPT;
+  }
+
+  const uint32_t *string_offsets = (const uint32_t *) (data + h->string_offsets_offset);
+  const uint8_t *string_data = data + h->string_data_offset;
+  uint64_t string_data_size = string_offsets[h->num_strings];
+  if (string_offsets[0] != 0 || string_data_size > size - h->string_data_offset) {
+    return PTBIN_ERR_CORRUPT;
+  }
+
+  /* Every string is non-empty in the data, ends in a NUL and starts where the previous one ended */
+  for (uint32_t i = 0; i < h->num_strings; ++i) {
+    if (string_offsets[i+1] <= string_offsets[i] || string_offsets[i+1] > string_data_size ||
+        string_data[string_offsets[i+1]-1] != 0) {
+      return PTBIN_ERR_CORRUPT;
+    }
+  }
+
+  uint64_t statements_end = ptbin_section_end(h->statements_offset, h->num_statements, sizeof(struct ptbin_statement),
+                                         h->string_data_offset + string_data_size, size);
+  if (!statements_end) {
+    return PTBIN_ERR_CORRUPT;
+  }
+  uint64_t terms_end = ptbin_section_end(h->terms_offset, h->num_terms, sizeof(struct ptbin_term),
+                                    statements_end, size);
+  if (!terms_end) {
+    return PTBIN_ERR_CORRUPT;
+  }
+
+  const struct ptbin_statement *statements = (const struct ptbin_statement *) (data + h->statements_offset);
+  for (uint32_t i = 0; i < h->num_statements; ++i) {
+    const struct ptbin_statement *s = &statements[i];
+    if (s->first_term > h->num_terms || s->num_terms > h->num_terms - s->first_term) {
+      return PTBIN_ERR_CORRUPT;
+    }
+  }
+
+  const struct ptbin_term *terms = (const struct ptbin_term *) (data + h->terms_offset);
+  for (uint64_t i = 0; i < h->num_terms; ++i) {
+    if (terms[i].num_factors > PTBIN_MAX_FACTORS || terms[i].num_sum_indices > PTBIN_MAX_SUM_INDICES) {
+      return PTBIN_ERR_CORRUPT;
+    }
+  }
+
+  bin->data           = data;
+  bin->size           = size;
+  bin->header         = h;
+  bin->string_offsets = string_offsets;
+  bin->string_data    = string_data;
+  bin->statements     = statements;
+  bin->terms          = terms;
+
+  return PTBIN_OK;
+}
+
+static inline enum ptbin_error ptbin_open(struct ptbin *bin, const char *filepath) {
+  memset(bin, 0, sizeof(struct ptbin));
+
+  int fd = open(filepath, O_RDONLY);
+  if (fd == -1) {
+    return PTBIN_ERR_IO;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) == -1 || st.st_size == 0) {
+    close(fd);
+    return PTBIN_ERR_IO;
+  }
+
+  void *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED) {
+    return PTBIN_ERR_IO;
+  }
+
+  enum ptbin_error err = ptbin_from_memory(bin, p, st.st_size);
+  if (err != PTBIN_OK) {
+    munmap(p, st.st_size);
+    return err;
+  }
+
+  return PTBIN_OK;
+}
+
+static inline void ptbin_close(struct ptbin *bin) {
+  if (bin->data) {
+    munmap((void *) bin->data, bin->size);
+  }
+  memset(bin, 0, sizeof(struct ptbin));
+}
+
+static inline uint32_t ptbin_num_statements(const struct ptbin *bin) {
+  return bin->header->num_statements;
+}
+
+static inline const struct ptbin_statement *ptbin_statement(const struct ptbin *bin, uint32_t i) {
+  return &bin->statements[i];
+}
+
+static inline uint64_t ptbin_num_terms(const struct ptbin *bin) {
+  return bin->header->num_terms;
+}
+
+static inline const struct ptbin_term *ptbin_term(const struct ptbin *bin, uint64_t i) {
+  return &bin->terms[i];
+}
+
+/* Returns NULL for PTBIN_NONE or out of range ids */
+static inline const char *ptbin_string(const struct ptbin *bin, uint32_t id) {
+  if (id >= bin->header->num_strings) {
+    return NULL;
+  }
+  return (const char *) bin->string_data + bin->string_offsets[id];
+}
@@ -1,95 +1,155 @@
-#include "inttypes.h"
-
-// libc
-#include <stdio.h>
-#include <string.h>
-#include <stdlib.h>
-#include <stdarg.h>
-#include <errno.h>
-#include <ctype.h>
-#include <stdbool.h>
-
-#define CBEGIN "\033["
-#define CEND   "m"
-
-#define FG_BLACK      "30"
-#define BG_BLACK      "40"
-#define FG_RED        "31"
-#define BG_RED        "41"
-#define FG_GREEN      "32"
-#define BG_GREEN      "42"
-#define FG_YELLOW     "33"
-#define BG_YELLOW     "43"
-#define FG_BLUE       "34"
-#define BG_BLUE       "44"
-#define FG_MAGENTA    "35"
-#define BG_MAGENTA    "45"
-#define FG_CYAN       "36"
-#define BG_CYAN       "46"
-#define FG_WHITE      "37"
-#define BG_WHITE      "47"
-#define RESET         "0"
-#define BOLD_ON       "1"
-#define UNDERLINE_ON  "4"
-#define INVERSE_ON    "7"
-#define BOLD_OFF      "21"
-#define UNDERLINE_OFF "24"
-#define INVERSE_OFF   "27"
-
-static void error(const char *fmt, ...) {
-  fprintf(stderr, CBEGIN FG_RED CEND);
-  fprintf(stderr, "Error: ");
-  fprintf(stderr, CBEGIN RESET CEND);
-
-  va_list args;
-  va_start(args, fmt);
-  vfprintf(stderr, fmt, args);
-  va_end(args);
-}
-
-static void die(const char *fmt, ...) {
-  fprintf(stderr, CBEGIN FG_RED ";" BOLD_ON CEND);
-  fprintf(stderr, "Fatal: ");
-  fprintf(stderr, CBEGIN RESET CEND);
-
-  va_list args;
-  va_start(args, fmt);
-  vfprintf(stderr, fmt, args);
-  va_end(args);
+/* accept4() for --serve, has to come before any system header */
+#define _GNU_SOURCE
+
+#include "libptgen.c"
+
+// posix
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/time.h>
+
+#include <stdatomic.h>
+
+enum output_format {
+  FORMAT_DOT = 1 << 0,
+  FORMAT_TEX = 1 << 1,
+  FORMAT_BIN = 1 << 2,
+  FORMAT_EVAL = 1 << 3,
+  FORMAT_EVAL_BIN = 1 << 4,
+};
 
-  abort();
+#include "server.c"
+#include "batch.c"
+
+static const u8 *usage =
+  "Usage: ptgen [--format=dot|tex|bin|eval|evalbin] [--cache-dir=path] [--cache-size=bytes]\n"
+  "             [--sweep=name=start:end:n] [--set=name=value]\n"
+  "             [--stats] [--progress] [--dump-tokens] input_file\n"
+  "       ptgen --batch [--manifest=path] [--format=dot|tex|bin] [--threads=n]\n"
+  "             [--cache-dir=path] [--cache-size=bytes] [--cache-memory=bytes]\n"
+  "             [--stats] [input_file...]\n"
+  "       ptgen --serve=socket_path|- [--threads=n] [--cache-dir=path] [--cache-size=bytes]\n"
+  "             [--cache-memory=bytes]\n";
+
+#ifndef PTGEN_NO_MAIN
+static void free_paths(const u8 **paths, u32 num_paths) {
+  for (u32 i = 0; i < num_paths; ++i) {
+    free((void *) paths[i]);
+  }
+  free(paths);
 }
 
-static void inline xassert(bool cond, const char *fmt, ...) {
-  if (!cond) {
-    va_list args;
-    va_start(args, fmt);
-    die(fmt, args);
-    va_end(args);
+i32 main(i32 argc, u8 **argv) {
+  u32 formats = FORMAT_DOT | FORMAT_TEX;
+  bool dump_tokens = false;
+  const u8 *filepath = NULL;
+  struct eval_param eval_params[EVAL_MAX_PARAMS];
+  u32 num_eval_params = 0;
+  const u8 *serve_path = NULL;
+  bool batch_mode = false;
+  /* Every positional argument, only --batch takes more than one */
+  const u8 **batch_paths = NULL;
+  u32 num_batch_paths = 0;
+  u32 num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  /* Size of the in-memory cache layer shared by the workers of --batch and --serve */
+  u64 cache_memory_size = CACHE_MEMORY_DEFAULT_MAX_SIZE;
+  bool cache_memory_set = false;
+  struct ptgen_options options = {
+    .cache_dir  = NULL,
+    .cache_size = CACHE_DEFAULT_MAX_SIZE,
+  };
+
+  for (i32 i = 1; i < argc; ++i) {
+    if (strncmp(argv[i], "--format=", 9) == 0) {
+      const u8 *format = argv[i] + 9;
+      if (strcmp(format, "dot") == 0) {
+        formats = FORMAT_DOT;
+      } else if (strcmp(format, "tex") == 0) {
+        formats = FORMAT_TEX;
+      } else if (strcmp(format, "bin") == 0) {
+        formats = FORMAT_BIN;
+      } else if (strcmp(format, "eval") == 0) {
+        formats = FORMAT_EVAL;
+      } else if (strcmp(format, "evalbin") == 0) {
+        formats = FORMAT_EVAL_BIN;
+      } else {
+        die("Unknown format %s\n%s", format, usage);
+      }
+    } else if (strncmp(argv[i], "--cache-dir=", 12) == 0) {
+      options.cache_dir = argv[i] + 12;
+    } else if (strncmp(argv[i], "--cache-size=", 13) == 0) {
+      options.cache_size = strtoull(argv[i] + 13, NULL, 10);
+    } else if (strncmp(argv[i], "--cache-memory=", 15) == 0) {
+      cache_memory_size = strtoull(argv[i] + 15, NULL, 10);
+      cache_memory_set = true;
+    } else if (strncmp(argv[i], "--sweep=", 8) == 0 || strncmp(argv[i], "--set=", 6) == 0) {
+      xassert(num_eval_params < EVAL_MAX_PARAMS, "too many --sweep/--set\n");
+      bool sweep = argv[i][2] == 's' && argv[i][3] == 'w';
+      parse_eval_param(&eval_params[num_eval_params++], strchr(argv[i], '=') + 1, sweep);
+    } else if (strcmp(argv[i], "--batch") == 0) {
+      batch_mode = true;
+    } else if (strncmp(argv[i], "--manifest=", 11) == 0) {
+      batch_mode = true;
+      num_batch_paths = batch_read_manifest(argv[i] + 11, &batch_paths, num_batch_paths);
+    } else if (strncmp(argv[i], "--serve=", 8) == 0) {
+      serve_path = argv[i] + 8;
+    } else if (strncmp(argv[i], "--threads=", 10) == 0) {
+      num_threads = strtoul(argv[i] + 10, NULL, 10);
+      xassert(num_threads > 0, "--threads needs at least one thread\n");
+    } else if (strcmp(argv[i], "--stats") == 0 || strcmp(argv[i], "--progress") == 0) {
+      xassert(PTGEN_STATS, "%s needs a build without -DPTGEN_STATS=0\n", argv[i]);
+      stats.enabled = true;
+      stats.progress |= argv[i][2] == 'p';
+    } else if (strcmp(argv[i], "--dump-tokens") == 0) {
+      dump_tokens = true;
+    } else if (strncmp(argv[i], "--", 2) == 0) {
+      die("Unknown option %s\n%s", argv[i], usage);
+    } else {
+      batch_paths = realloc(batch_paths, (num_batch_paths+1) * sizeof(const u8 *));
+      if (!batch_paths) {
+        die("Failed to realloc - %s\n", strerror(errno));
+      }
+      batch_paths[num_batch_paths] = strdup(argv[i]);
+      if (!batch_paths[num_batch_paths]) {
+        die("strdup failed - %s\n", strerror(errno));
+      }
+      num_batch_paths++;
+    }
   }
-}
 
-static const char *xstrndup(const char *src, u8 len) {
-  const char *ret = strndup(src, len);
-  if (!ret) {
-    die("strndup failed - %s\n", strerror(errno));
+  if (serve_path) {
+    xassert(!stats.enabled, "--serve doesn't support --stats or --progress\n");
+    serve(serve_path, num_threads, &options, cache_memory_size);
+    return 0;
   }
-  return ret;
-};
 
-#include "lexer.c"
-#include "ast.c"
-#include "parser.c"
+  if (batch_mode) {
+    xassert(!(formats & (FORMAT_EVAL | FORMAT_EVAL_BIN)), "--batch doesn't support --format=eval\n");
+    xassert(num_batch_paths > 0, "No inputs\n%s", usage);
 
-i32 main(i32 argc, u8 **argv) {
-  if (argc != 2) {
-    die("Usage: ptgen input_file");
+    u32 num_failed = batch(batch_paths, num_batch_paths, formats, num_threads, &options, cache_memory_size);
+    free_paths(batch_paths, num_batch_paths);
+    if (stats.enabled) {
+      dump_stats_json(stdout, ast_node_names, sizeof(ast_node_names)/sizeof(ast_node_names[0]));
+    }
+    return num_failed ? 1 : 0;
+  }
+
+  if (num_batch_paths != 1) {
+    die(usage);
   }
+  xassert(!cache_memory_set, "--cache-memory needs --batch or --serve\n");
+  filepath = batch_paths[0];
 
-  const u8 *filepath = argv[1];
+  struct ptgen_context *ctx = ptgen_context_new(&options);
+  xassert(ctx, "(ptgen_context_new) %s\n", strerror(errno));
 
   /* Open and read entire file into buffer */
 
+  STATS_BEGIN(STATS_READ);
+
   FILE *fd = fopen(filepath, "r");
   xassert(fd, "(fopen) %s\n", strerror(errno));
 
@@ -100,19 +160,57 @@ i32 main(i32 argc, u8 **argv) {
 
   xassert(fseek(fd, 0, SEEK_SET) != -1, "(fseek) %s\n", strerror(errno));
 
-  u8 buf[size+1];
-  buf[size] = 0;
-
+  u8 *buf = context_input(ctx, filepath, size);
   xassert(fread(buf, 1, size, fd) == size, "(fread) failed to read entire file!\n");
 
-  struct token_buffer tok_buf;
-  lex(&tok_buf, filepath, buf, size);
-  dump_token_buffer(&tok_buf);
+  fclose(fd);
 
-  struct ast_node *root = parse(&tok_buf);
-  dump_ast_to_dot(root, "ast.dot");
-  dump_ast_to_tex(root, "ast.tex");
+  STATS_END(STATS_READ);
+
+  context_lex(ctx, size);
+
+  if (dump_tokens) {
+    dump_token_buffer(&ctx->tok_buf);
+  }
+
+  struct output out;
+  if (formats & FORMAT_DOT) {
+    output_open(&out, "ast.dot");
+    context_emit(ctx, PTGEN_FORMAT_DOT, &out);
+    output_close(&out);
+  }
+  if (formats & FORMAT_TEX) {
+    output_open(&out, "ast.tex");
+    context_emit(ctx, PTGEN_FORMAT_TEX, &out);
+    output_close(&out);
+  }
+  if (formats & (FORMAT_EVAL | FORMAT_EVAL_BIN)) {
+    struct symbol_table tab = {0};
+    bool binary = formats & FORMAT_EVAL_BIN;
+    context_parse(ctx);
+    STATS_BEGIN(STATS_EVAL);
+    dump_eval(ctx->roots, ctx->num_statements, &tab, eval_params, num_eval_params, binary, binary ? "eval.bin" : "eval.txt");
+    STATS_END(STATS_EVAL);
+  }
+  if (formats & FORMAT_BIN) {
+    context_expand(ctx);
+    output_open(&out, "terms.bin");
+    context_emit(ctx, PTGEN_FORMAT_BIN, &out);
+    output_close(&out);
+
+    if (ctx->cache.dir) {
+      cache_evict(&ctx->cache);
+      ctx->stores_since_evict = 0;
+    }
+  }
+
+  if (stats.enabled) {
+    dump_stats_json(stdout, ast_node_names, sizeof(ast_node_names)/sizeof(ast_node_names[0]));
+  }
+
+  ptgen_context_free(ctx);
+  free_paths(batch_paths, num_batch_paths);
 
-  fclose(fd);
   return 0;
 }
+#endif
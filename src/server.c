@@ -0,0 +1,281 @@
+/*
+ * ptgen --serve, a long running process answering requests over a Unix
+ * domain socket, or over stdin/stdout with --serve=-.
+ *
+ * The --threads workers share one epoll set holding the listening socket
+ * and every idle connection, all registered one-shot. A worker takes one
+ * ready connection, serves a single request and puts the connection back,
+ * so idle connections don't hold a worker and any number of them can be
+ * open at once. Each worker owns a ptgen_context, which keeps its symbols
+ * and storage across requests, and all of them share an in-memory cache
+ * layer of --cache-memory bytes so a statement is only expanded once (plus
+ * --cache-dir if given). The server doesn't collect --stats.
+ *
+ * A client sends any number of requests on a connection and gets the
+ * responses back in order. All integers are in native endianness since
+ * both ends are on the same machine.
+ *
+ *   request:  u32 size, u32 format (enum ptgen_format), u8 input[size]
+ *   response: u32 size, u32 status (enum ptgen_error),  u8 data[size]
+ *
+ * data is the emitted output if status is PTGEN_OK and the error message
+ * otherwise. Malformed requests get a PTGEN_ERR_ARGS response after which
+ * the connection is closed, as are connections that stall for more than
+ * SERVER_IO_TIMEOUT seconds in the middle of a request or response.
+ */
+
+#define SERVER_MAX_REQUEST_SIZE (64u << 20)
+#define SERVER_BACKLOG 64
+#define SERVER_IO_TIMEOUT 5
+
+/* Pause in accepting when out of descriptors or memory, doubled while it lasts */
+#define SERVER_BACKOFF_MIN_MS 10
+#define SERVER_BACKOFF_MAX_MS 1000
+
+struct server_header {
+  u32 size;
+  u32 code;   /* format of a request, status of a response */
+};
+
+struct server {
+  i32 listen_fd;
+  i32 epoll_fd;
+  struct ptgen_options options;
+  struct cache_memory memory;
+
+  /* Only used by the worker holding the one-shot listen event, which moves between workers */
+  _Atomic u32 backoff_ms;
+};
+
+/* Grows to the largest request seen by a worker */
+struct server_buffer {
+  u8 *data;
+  u64 cap;
+};
+
+/* Returns false on end of stream or error, which just ends the connection */
+static bool server_read(i32 fd, void *data, u64 len) {
+  u8 *at = data;
+  while (len > 0) {
+    ssize_t n = read(fd, at, len);
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    at  += n;
+    len -= n;
+  }
+  return true;
+}
+
+static bool server_respond(i32 fd, enum ptgen_error status, const u8 *data, u64 size) {
+  struct server_header h = {
+    .size = size,
+    .code = status,
+  };
+
+  struct iovec iov[2] = {
+    { .iov_base = &h,           .iov_len = sizeof(h) },
+    { .iov_base = (void *)data, .iov_len = size },
+  };
+
+  /* Header and data usually go out in a single writev */
+  u32 i = 0;
+  while (i < 2) {
+    ssize_t n = writev(fd, iov + i, 2 - i);
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    if (n == -1) {
+      return false;
+    }
+    while (i < 2 && (u64) n >= iov[i].iov_len) {
+      n -= iov[i].iov_len;
+      i++;
+    }
+    if (i < 2) {
+      iov[i].iov_base = (u8 *) iov[i].iov_base + n;
+      iov[i].iov_len -= n;
+    }
+  }
+  return true;
+}
+
+/* Serves one request, returns false once the connection should be closed */
+static bool server_request(struct ptgen_context *ctx, struct server_buffer *buf, i32 in_fd, i32 out_fd) {
+  struct server_header h;
+  if (!server_read(in_fd, &h, sizeof(h))) {
+    return false;
+  }
+
+  if (h.size > SERVER_MAX_REQUEST_SIZE) {
+    const u8 *msg = "Request too large\n";
+    server_respond(out_fd, PTGEN_ERR_ARGS, msg, strlen(msg));
+    return false;
+  }
+
+  if (h.size > buf->cap) {
+    free(buf->data);
+    buf->cap = h.size;
+    buf->data = malloc(buf->cap);
+    if (!buf->data) {
+      die("Failed to malloc - %s\n", strerror(errno));
+    }
+  }
+  if (!server_read(in_fd, buf->data, h.size)) {
+    return false;
+  }
+
+  const uint8_t *data;
+  uint64_t size;
+  enum ptgen_error err = ptgen_lex(ctx, "<request>", buf->data, h.size);
+  if (err == PTGEN_OK) {
+    err = ptgen_emit(ctx, h.code, &data, &size);
+  }
+  if (err != PTGEN_OK) {
+    data = ptgen_error_message(ctx);
+    size = strlen(data);
+  }
+
+  return server_respond(out_fd, err, data, size);
+}
+
+/* (Re)arms fd in the epoll set, it is reported to one worker once readable */
+static bool server_watch(struct server *s, i32 fd, i32 op) {
+  struct epoll_event ev = {
+    .events  = EPOLLIN | EPOLLONESHOT,
+    .data.fd = fd,
+  };
+  return epoll_ctl(s->epoll_fd, op, fd, &ev) != -1;
+}
+
+/* Accepts every pending connection, the listening socket is non-blocking */
+static void server_accept(struct server *s) {
+  for (;;) {
+    i32 fd = accept4(s->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (fd == -1) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        atomic_store_explicit(&s->backoff_ms, 0, memory_order_relaxed);
+        break;
+      }
+      xassert(errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM,
+              "(accept4) %s\n", strerror(errno));
+
+      /* Connections stay in the backlog until some are closed and descriptors free up */
+      u32 ms = atomic_load_explicit(&s->backoff_ms, memory_order_relaxed);
+      ms = ms ? 2*ms : SERVER_BACKOFF_MIN_MS;
+      if (ms > SERVER_BACKOFF_MAX_MS) {
+        ms = SERVER_BACKOFF_MAX_MS;
+      }
+      atomic_store_explicit(&s->backoff_ms, ms, memory_order_relaxed);
+      struct timespec ts = {
+        .tv_sec  = ms / 1000,
+        .tv_nsec = (ms % 1000) * 1000000l,
+      };
+      nanosleep(&ts, NULL);
+      break;
+    }
+
+    /* Only applies while a worker is in the middle of a request on fd */
+    struct timeval tv = { .tv_sec = SERVER_IO_TIMEOUT };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    if (!server_watch(s, fd, EPOLL_CTL_ADD)) {
+      close(fd);
+    }
+  }
+
+  xassert(server_watch(s, s->listen_fd, EPOLL_CTL_MOD), "(epoll_ctl) %s\n", strerror(errno));
+}
+
+static void *server_worker(void *arg) {
+  struct server *s = arg;
+
+  struct ptgen_context *ctx = ptgen_context_new(&s->options);
+  xassert(ctx, "(ptgen_context_new) %s\n", strerror(errno));
+  ctx->cache.memory = &s->memory;
+  struct server_buffer buf = {0};
+
+  for (;;) {
+    struct epoll_event ev;
+    i32 n = epoll_wait(s->epoll_fd, &ev, 1, -1);
+    if (n == -1) {
+      xassert(errno == EINTR, "(epoll_wait) %s\n", strerror(errno));
+      continue;
+    }
+
+    i32 fd = ev.data.fd;
+    if (fd == s->listen_fd) {
+      server_accept(s);
+    } else if (!(ev.events & EPOLLIN) || !server_request(ctx, &buf, fd, fd) ||
+               !server_watch(s, fd, EPOLL_CTL_MOD)) {
+      close(fd);
+    }
+  }
+
+  return NULL;
+}
+
+/* Only returns in stdin/stdout mode, once stdin is closed */
+static void serve(const u8 *path, u32 num_threads, struct ptgen_options *options, u64 cache_memory_size) {
+  /* A client going away shouldn't take the server with it */
+  signal(SIGPIPE, SIG_IGN);
+
+  struct server s = {
+    .options = *options,
+  };
+  cache_memory_init(&s.memory, cache_memory_size);
+
+  if (strcmp(path, "-") == 0) {
+    struct ptgen_context *ctx = ptgen_context_new(options);
+    xassert(ctx, "(ptgen_context_new) %s\n", strerror(errno));
+    ctx->cache.memory = &s.memory;
+    struct server_buffer buf = {0};
+    while (server_request(ctx, &buf, STDIN_FILENO, STDOUT_FILENO));
+    free(buf.data);
+    ptgen_context_free(ctx);
+    cache_memory_free(&s.memory);
+    return;
+  }
+
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  xassert(strlen(path) < sizeof(addr.sun_path), "socket path too long: %s\n", path);
+  strcpy(addr.sun_path, path);
+
+  /* Replaces a socket left behind by an earlier server, but nothing else */
+  struct stat st;
+  if (lstat(path, &st) == 0) {
+    xassert(S_ISSOCK(st.st_mode), "%s exists and is not a socket\n", path);
+    xassert(unlink(path) != -1, "(unlink) %s: %s\n", path, strerror(errno));
+  } else {
+    xassert(errno == ENOENT, "(lstat) %s: %s\n", path, strerror(errno));
+  }
+
+  s.listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  xassert(s.listen_fd != -1, "(socket) %s\n", strerror(errno));
+  xassert(bind(s.listen_fd, (struct sockaddr *) &addr, sizeof(addr)) != -1, "(bind) %s\n", strerror(errno));
+  xassert(listen(s.listen_fd, SERVER_BACKLOG) != -1, "(listen) %s\n", strerror(errno));
+
+  s.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  xassert(s.epoll_fd != -1, "(epoll_create1) %s\n", strerror(errno));
+  xassert(server_watch(&s, s.listen_fd, EPOLL_CTL_ADD), "(epoll_ctl) %s\n", strerror(errno));
+
+  pthread_t *threads = malloc(num_threads * sizeof(pthread_t));
+  if (!threads) {
+    die("Failed to malloc - %s\n", strerror(errno));
+  }
+  for (u32 i = 0; i < num_threads; ++i) {
+    i32 err = pthread_create(&threads[i], NULL, server_worker, &s);
+    xassert(err == 0, "(pthread_create) %s\n", strerror(err));
+  }
+
+  for (u32 i = 0; i < num_threads; ++i) {
+    pthread_join(threads[i], NULL);
+  }
+}
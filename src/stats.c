@@ -0,0 +1,163 @@
+/*
+ * Instrumentation for --stats
+ *
+ * Everything goes through the STATS_* macros, which compile to nothing
+ * when built with -DPTGEN_STATS=0, such builds reject --stats and
+ * --progress. When compiled in but not enabled at runtime they cost a
+ * single predictable branch.
+ */
+
+#ifndef PTGEN_STATS
+#define PTGEN_STATS 1
+#endif
+
+#define STATS_MAX_NODE_TYPES 16
+
+/* Seconds between progress lines */
+#define STATS_PROGRESS_INTERVAL 1.0
+
+enum stats_phase {
+  STATS_READ,
+  STATS_LEX,
+  STATS_SPLIT,
+  STATS_PARSE,
+  STATS_EXPAND,
+  STATS_EMIT_DOT,
+  STATS_EMIT_TEX,
+  STATS_EMIT_BIN,
+  STATS_EVAL,
+  STATS_NUM_PHASES,
+};
+
+static const u8 *stats_phase_names[] = {
+  [STATS_READ]     = "read",
+  [STATS_LEX]      = "lex",
+  [STATS_SPLIT]    = "split",
+  [STATS_PARSE]    = "parse",
+  [STATS_EXPAND]   = "expand",
+  [STATS_EMIT_DOT] = "emit_dot",
+  [STATS_EMIT_TEX] = "emit_tex",
+  [STATS_EMIT_BIN] = "emit_bin",
+  [STATS_EVAL]     = "eval",
+};
+
+struct stats {
+  bool enabled;
+  bool progress;
+
+  double phase_begin[STATS_NUM_PHASES];
+  double phase_time[STATS_NUM_PHASES];
+  double last_progress;
+
+  u64 tokens;
+  u64 nodes[STATS_MAX_NODE_TYPES];
+  u64 bytes_allocated;
+  u64 terms_generated;
+  u64 terms_merged;
+  u64 cache_hits;
+  u64 cache_misses;
+};
+
+/* Per thread, so contexts running concurrently don't race on the counters */
+static _Thread_local struct stats stats;
+
+static inline double stats_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void stats_progress() {
+  double t = stats_now();
+  if (t - stats.last_progress < STATS_PROGRESS_INTERVAL) {
+    return;
+  }
+  stats.last_progress = t;
+
+  fprintf(stderr, "progress: %llu terms generated, %llu merged, %llu bytes allocated\n",
+          stats.terms_generated, stats.terms_merged, stats.bytes_allocated);
+}
+
+#if PTGEN_STATS
+
+#define STATS_ADD(field, n)                                   \
+  do {                                                        \
+    if (__builtin_expect(stats.enabled, 0)) {                 \
+      stats.field += (n);                                     \
+    }                                                         \
+  } while (0)
+
+#define STATS_BEGIN(phase)                                    \
+  do {                                                        \
+    if (__builtin_expect(stats.enabled, 0)) {                 \
+      stats.phase_begin[phase] = stats_now();                 \
+    }                                                         \
+  } while (0)
+
+#define STATS_END(phase)                                      \
+  do {                                                        \
+    if (__builtin_expect(stats.enabled, 0)) {                 \
+      stats.phase_time[phase] += stats_now() - stats.phase_begin[phase]; \
+    }                                                         \
+  } while (0)
+
+#define STATS_CALL(expr)                                      \
+  do {                                                        \
+    if (__builtin_expect(stats.enabled, 0)) {                 \
+      expr;                                                   \
+    }                                                         \
+  } while (0)
+
+/* Only looks at the clock every 64k terms */
+#define STATS_TERM_GENERATED()                                \
+  do {                                                        \
+    if (__builtin_expect(stats.enabled, 0)) {                 \
+      if ((++stats.terms_generated & 0xffff) == 0 && stats.progress) { \
+        stats_progress();                                     \
+      }                                                       \
+    }                                                         \
+  } while (0)
+
+#else
+
+#define STATS_ADD(field, n)     ((void) 0)
+#define STATS_BEGIN(phase)      ((void) 0)
+#define STATS_END(phase)        ((void) 0)
+#define STATS_CALL(expr)        ((void) 0)
+#define STATS_TERM_GENERATED()  ((void) 0)
+
+#endif
+
+/* Adds up the stats of worker threads, phase times become summed over threads */
+static void stats_merge(struct stats *dst, struct stats *src) {
+  for (u32 i = 0; i < STATS_NUM_PHASES; ++i) {
+    dst->phase_time[i] += src->phase_time[i];
+  }
+  dst->tokens += src->tokens;
+  for (u32 i = 0; i < STATS_MAX_NODE_TYPES; ++i) {
+    dst->nodes[i] += src->nodes[i];
+  }
+  dst->bytes_allocated += src->bytes_allocated;
+  dst->terms_generated += src->terms_generated;
+  dst->terms_merged    += src->terms_merged;
+  dst->cache_hits      += src->cache_hits;
+  dst->cache_misses    += src->cache_misses;
+}
+
+static void dump_stats_json(FILE *fd, const u8 **node_names, u32 num_node_types) {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+
+  fprintf(fd, "{\"phases\": {");
+  for (u32 i = 0; i < STATS_NUM_PHASES; ++i) {
+    fprintf(fd, "%s\"%s\": %.9f", i ? ", " : "", stats_phase_names[i], stats.phase_time[i]);
+  }
+  fprintf(fd, "}, \"tokens\": %llu, \"nodes\": {", stats.tokens);
+  for (u32 i = 0; i < num_node_types; ++i) {
+    fprintf(fd, "%s\"%s\": %llu", i ? ", " : "", node_names[i], stats.nodes[i]);
+  }
+  fprintf(fd, "}, \"bytes_allocated\": %llu, \"terms_generated\": %llu, \"terms_merged\": %llu, "
+          "\"cache_hits\": %llu, \"cache_misses\": %llu, \"peak_rss_kb\": %ld}\n",
+          stats.bytes_allocated, stats.terms_generated, stats.terms_merged,
+          stats.cache_hits, stats.cache_misses, usage.ru_maxrss);
+}
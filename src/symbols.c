@@ -0,0 +1,99 @@
+/*
+ * Interned strings. Every distinct identifier gets a dense u32 id which is
+ * what the expanded terms and the binary output refer to.
+ */
+
+#define SYMBOL_NONE 0xffffffff
+
+struct symbol_table {
+  const u8 **strings;
+  u32 *lens;
+  u32 num_symbols;
+  u32 cap;
+
+  /* Backing storage of the strings */
+  struct arena arena;
+
+  /* Open addressing, holds symbol id + 1 so 0 means empty */
+  u32 *buckets;
+  u32 num_buckets;
+};
+
+static inline u32 hash_str(const u8 *str, u32 len) {
+  u32 hash = 2166136261u;
+  for (u32 i = 0; i < len; ++i) {
+    hash ^= str[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static void symbol_table_rehash(struct symbol_table *tab, u32 num_buckets) {
+  free(tab->buckets);
+  tab->buckets = calloc(num_buckets, sizeof(u32));
+  if (!tab->buckets) {
+    die("Failed to calloc - %s\n", strerror(errno));
+  }
+  tab->num_buckets = num_buckets;
+
+  for (u32 id = 0; id < tab->num_symbols; ++id) {
+    u32 b = hash_str(tab->strings[id], tab->lens[id]) & (num_buckets-1);
+    while (tab->buckets[b]) {
+      b = (b+1) & (num_buckets-1);
+    }
+    tab->buckets[b] = id+1;
+  }
+}
+
+static u32 symbol_intern(struct symbol_table *tab, const u8 *str, u32 len) {
+  /* Keep load factor below 1/2 */
+  if (2*(tab->num_symbols+1) > tab->num_buckets) {
+    symbol_table_rehash(tab, tab->num_buckets ? 2*tab->num_buckets : 64);
+  }
+
+  u32 b = hash_str(str, len) & (tab->num_buckets-1);
+  while (tab->buckets[b]) {
+    u32 id = tab->buckets[b]-1;
+    if (tab->lens[id] == len && memcmp(tab->strings[id], str, len) == 0) {
+      return id;
+    }
+    b = (b+1) & (tab->num_buckets-1);
+  }
+
+  if (tab->num_symbols == tab->cap) {
+    tab->cap = tab->cap ? 2*tab->cap : 64;
+    tab->strings = realloc(tab->strings, tab->cap * sizeof(const u8 *));
+    tab->lens    = realloc(tab->lens,    tab->cap * sizeof(u32));
+    if (!tab->strings || !tab->lens) {
+      die("Failed to realloc - %s\n", strerror(errno));
+    }
+  }
+
+  u32 id = tab->num_symbols++;
+  tab->strings[id] = arena_strndup(&tab->arena, str, len);
+  tab->lens[id]    = len;
+  tab->buckets[b]  = id+1;
+
+  return id;
+}
+
+static inline u32 symbol_intern_cstr(struct symbol_table *tab, const u8 *str) {
+  return symbol_intern(tab, str, strlen(str));
+}
+
+/* Forgets every symbol but keeps the storage around for reuse */
+static void symbol_table_clear(struct symbol_table *tab) {
+  tab->num_symbols = 0;
+  arena_reset(&tab->arena);
+  if (tab->buckets) {
+    memset(tab->buckets, 0, tab->num_buckets * sizeof(u32));
+  }
+}
+
+static void symbol_table_free(struct symbol_table *tab) {
+  arena_free(&tab->arena);
+  free(tab->strings);
+  free(tab->lens);
+  free(tab->buckets);
+  memset(tab, 0, sizeof(struct symbol_table));
+}
@@ -0,0 +1,388 @@
+/*
+ * Expansion of a parsed statement into a flat list of terms
+ *
+ *   coeff * sum_{indices} T0_{i0} T1_{i1} ...
+ *
+ * where each factor is a tensor symbol with an optional index symbol.
+ * Products are distributed over sums, sums only contribute their indices.
+ * Identical terms are merged afterwards and vanishing ones dropped.
+ */
+
+#define TERM_MAX_FACTORS     16
+#define TERM_MAX_SUM_INDICES 8
+
+struct term {
+  i64 coeff;
+  u8 num_factors;
+  u8 num_sum_indices;
+  u32 tensors[TERM_MAX_FACTORS];
+  u32 indices[TERM_MAX_FACTORS];
+  u32 sum_indices[TERM_MAX_SUM_INDICES];
+};
+
+struct term_list {
+  struct term *terms;
+  u64 num_terms;
+  u64 cap;
+};
+
+struct expansion {
+  u32 lhs;
+  struct term_list list;
+};
+
+static inline struct term *term_list_push(struct term_list *list) {
+  if (list->num_terms == list->cap) {
+    STATS_ADD(bytes_allocated, (list->cap ? list->cap : 64) * sizeof(struct term));
+    list->cap = list->cap ? 2*list->cap : 64;
+    list->terms = realloc(list->terms, list->cap * sizeof(struct term));
+    if (!list->terms) {
+      die("Failed to realloc - %s\n", strerror(errno));
+    }
+  }
+  struct term *t = &list->terms[list->num_terms++];
+  memset(t, 0, sizeof(struct term));
+  STATS_TERM_GENERATED();
+  return t;
+}
+
+static void term_list_free(struct term_list *list) {
+  free(list->terms);
+  memset(list, 0, sizeof(struct term_list));
+}
+
+static void expand_node(struct ast_node *node, struct symbol_table *tab, struct term_list *out);
+
+/* Binary op nodes carry no location */
+static inline void expand_error_location(struct ast_node *node) {
+  if (node->loc.at) {
+    print_location(&node->loc, "here\n");
+  }
+}
+
+static inline bool is_mul_op(struct ast_node *node) {
+  return node->type == AST_BINARY_OP && node->name[0] == '*';
+}
+
+static void multiply_terms(struct ast_node *node, struct term_list *lhs, struct term_list *rhs, struct term_list *out) {
+  for (u64 i = 0; i < lhs->num_terms; ++i) {
+    for (u64 j = 0; j < rhs->num_terms; ++j) {
+      struct term *a = &lhs->terms[i];
+      struct term *b = &rhs->terms[j];
+
+      if (a->num_factors + b->num_factors > TERM_MAX_FACTORS ||
+          a->num_sum_indices + b->num_sum_indices > TERM_MAX_SUM_INDICES) {
+        expand_error_location(node);
+        die("Term exceeds %u factors or %u summation indices!\n",
+            TERM_MAX_FACTORS, TERM_MAX_SUM_INDICES);
+      }
+
+      struct term *t = term_list_push(out);
+      t->coeff = a->coeff * b->coeff;
+
+      memcpy(t->tensors, a->tensors, a->num_factors * sizeof(u32));
+      memcpy(t->indices, a->indices, a->num_factors * sizeof(u32));
+      memcpy(t->tensors + a->num_factors, b->tensors, b->num_factors * sizeof(u32));
+      memcpy(t->indices + a->num_factors, b->indices, b->num_factors * sizeof(u32));
+      t->num_factors = a->num_factors + b->num_factors;
+
+      memcpy(t->sum_indices, a->sum_indices, a->num_sum_indices * sizeof(u32));
+      memcpy(t->sum_indices + a->num_sum_indices, b->sum_indices, b->num_sum_indices * sizeof(u32));
+      t->num_sum_indices = a->num_sum_indices + b->num_sum_indices;
+    }
+  }
+}
+
+/*
+ * Long products parse into a left leaning chain of * just like sums do,
+ * multiply along its spine from the innermost operand outwards.
+ */
+static void expand_product(struct ast_node *node, struct symbol_table *tab, struct term_list *out) {
+  struct emit_stack spine = {0};
+  while (is_mul_op(node)) {
+    emit_push_node(&spine, node);
+    node = node->children[0];
+  }
+
+  struct term_list lhs = {0};
+  struct term_list rhs = {0};
+  struct term_list tmp = {0};
+  expand_node(node, tab, &lhs);
+
+  while (spine.len > 0) {
+    struct ast_node *op = spine.items[--spine.len].node;
+    rhs.num_terms = 0;
+    expand_node(op->children[1], tab, &rhs);
+    if (spine.len == 0) {
+      multiply_terms(op, &lhs, &rhs, out);
+    } else {
+      tmp.num_terms = 0;
+      multiply_terms(op, &lhs, &rhs, &tmp);
+      struct term_list swap = lhs;
+      lhs = tmp;
+      tmp = swap;
+    }
+  }
+
+  term_list_free(&lhs);
+  term_list_free(&rhs);
+  term_list_free(&tmp);
+  free(spine.items);
+}
+
+static inline bool is_add_op(struct ast_node *node) {
+  return node->type == AST_BINARY_OP && (node->name[0] == '+' || node->name[0] == '-');
+}
+
+/*
+ * Long sums parse into a left leaning chain of + and -, walk its spine
+ * iteratively so the recursion depth doesn't grow with the number of terms.
+ */
+static void expand_add(struct ast_node *node, struct symbol_table *tab, struct term_list *out) {
+  struct emit_stack spine = {0};
+  while (is_add_op(node)) {
+    emit_push_node(&spine, node);
+    node = node->children[0];
+  }
+
+  expand_node(node, tab, out);
+
+  while (spine.len > 0) {
+    struct ast_node *op = spine.items[--spine.len].node;
+    u64 first = out->num_terms;
+    expand_node(op->children[1], tab, out);
+    if (op->name[0] == '-') {
+      for (u64 i = first; i < out->num_terms; ++i) {
+        out->terms[i].coeff = -out->terms[i].coeff;
+      }
+    }
+  }
+
+  free(spine.items);
+}
+
+static void expand_node(struct ast_node *node, struct symbol_table *tab, struct term_list *out) {
+  switch (node->type) {
+  case AST_CONSTANT: {
+    struct term *t = term_list_push(out);
+    t->coeff = node->constant.value;
+  } break;
+  case AST_VAR: {
+    struct term *t = term_list_push(out);
+    t->coeff = 1;
+    t->tensors[0] = symbol_intern_cstr(tab, node->name);
+    t->indices[0] = SYMBOL_NONE;
+    t->num_factors = 1;
+  } break;
+  case AST_CREATE_OP:
+  case AST_ANNIHI_OP: {
+    struct term *t = term_list_push(out);
+    t->coeff = 1;
+    t->tensors[0] = symbol_intern_cstr(tab, node->name);
+    t->indices[0] = symbol_intern_cstr(tab, node->children[0]->name);
+    t->num_factors = 1;
+  } break;
+  case AST_SUM: {
+    u8 num_ids = ast_num_children(node) - 1;
+    u64 first = out->num_terms;
+    expand_node(node->children[num_ids], tab, out);
+    for (u64 i = first; i < out->num_terms; ++i) {
+      struct term *t = &out->terms[i];
+      if (t->num_sum_indices + num_ids > TERM_MAX_SUM_INDICES) {
+        expand_error_location(node);
+        die("Term exceeds %u summation indices!\n", TERM_MAX_SUM_INDICES);
+      }
+      for (u8 j = 0; j < num_ids; ++j) {
+        t->sum_indices[t->num_sum_indices++] = symbol_intern_cstr(tab, node->children[j]->name);
+      }
+    }
+  } break;
+  case AST_UNARY_OP: {
+    u64 first = out->num_terms;
+    expand_node(node->children[0], tab, out);
+    if (node->name[0] == '-') {
+      for (u64 i = first; i < out->num_terms; ++i) {
+        out->terms[i].coeff = -out->terms[i].coeff;
+      }
+    }
+  } break;
+  case AST_BINARY_OP: {
+    switch (node->name[0]) {
+    case '+':
+    case '-':
+      expand_add(node, tab, out);
+      break;
+    case '*':
+      expand_product(node, tab, out);
+      break;
+    default:
+      expand_error_location(node);
+      die("Cannot expand binary operator %s!\n", node->name);
+    }
+  } break;
+  default:
+    expand_error_location(node);
+    die("Cannot expand %s!\n", ast_node_names[node->type]);
+  }
+}
+
+/*
+ * Finds everything expand_node() would fail on before a single term is
+ * generated, so dying out of a library call never strands partial term
+ * lists. The largest term of a product is made of the largest terms of
+ * its operands, which makes these limits exact rather than conservative.
+ */
+static void expand_check(struct ast_node *node, u32 *max_factors, u32 *max_sum_indices) {
+  switch (node->type) {
+  case AST_CONSTANT:
+    *max_factors = 0;
+    *max_sum_indices = 0;
+    break;
+  case AST_VAR:
+  case AST_CREATE_OP:
+  case AST_ANNIHI_OP:
+    *max_factors = 1;
+    *max_sum_indices = 0;
+    break;
+  case AST_SUM: {
+    u8 num_ids = ast_num_children(node) - 1;
+    expand_check(node->children[num_ids], max_factors, max_sum_indices);
+    *max_sum_indices += num_ids;
+    if (*max_sum_indices > TERM_MAX_SUM_INDICES) {
+      expand_error_location(node);
+      die("Term exceeds %u summation indices!\n", TERM_MAX_SUM_INDICES);
+    }
+  } break;
+  case AST_UNARY_OP:
+    expand_check(node->children[0], max_factors, max_sum_indices);
+    break;
+  case AST_BINARY_OP: {
+    u32 f, s;
+    switch (node->name[0]) {
+    case '+':
+    case '-':
+      /* Same iterative walk down the spine as expand_add() */
+      *max_factors = 0;
+      *max_sum_indices = 0;
+      while (is_add_op(node)) {
+        expand_check(node->children[1], &f, &s);
+        *max_factors     = f > *max_factors ? f : *max_factors;
+        *max_sum_indices = s > *max_sum_indices ? s : *max_sum_indices;
+        node = node->children[0];
+      }
+      expand_check(node, &f, &s);
+      *max_factors     = f > *max_factors ? f : *max_factors;
+      *max_sum_indices = s > *max_sum_indices ? s : *max_sum_indices;
+      break;
+    case '*': {
+      /* Products get the same treatment */
+      struct emit_stack spine = {0};
+      while (is_mul_op(node)) {
+        emit_push_node(&spine, node);
+        node = node->children[0];
+      }
+      expand_check(node, max_factors, max_sum_indices);
+      while (spine.len > 0) {
+        node = spine.items[--spine.len].node;
+        expand_check(node->children[1], &f, &s);
+        *max_factors += f;
+        *max_sum_indices += s;
+        if (*max_factors > TERM_MAX_FACTORS || *max_sum_indices > TERM_MAX_SUM_INDICES) {
+          free(spine.items);
+          expand_error_location(node);
+          die("Term exceeds %u factors or %u summation indices!\n",
+              TERM_MAX_FACTORS, TERM_MAX_SUM_INDICES);
+        }
+      }
+      free(spine.items);
+    } break;
+    default:
+      expand_error_location(node);
+      die("Cannot expand binary operator %s!\n", node->name);
+    }
+  } break;
+  default:
+    expand_error_location(node);
+    die("Cannot expand %s!\n", ast_node_names[node->type]);
+  }
+}
+
+static inline u32 hash_term(struct term *t) {
+  u32 hash = 2166136261u;
+#define HASH_U32(x) hash = (hash ^ (x)) * 16777619u
+  HASH_U32(t->num_factors);
+  for (u8 i = 0; i < t->num_factors; ++i) {
+    HASH_U32(t->tensors[i]);
+    HASH_U32(t->indices[i]);
+  }
+  HASH_U32(t->num_sum_indices);
+  for (u8 i = 0; i < t->num_sum_indices; ++i) {
+    HASH_U32(t->sum_indices[i]);
+  }
+#undef HASH_U32
+  return hash;
+}
+
+static inline bool same_operators(struct term *a, struct term *b) {
+  return a->num_factors == b->num_factors &&
+         a->num_sum_indices == b->num_sum_indices &&
+         memcmp(a->tensors, b->tensors, a->num_factors * sizeof(u32)) == 0 &&
+         memcmp(a->indices, b->indices, a->num_factors * sizeof(u32)) == 0 &&
+         memcmp(a->sum_indices, b->sum_indices, a->num_sum_indices * sizeof(u32)) == 0;
+}
+
+/* Adds up the coefficients of terms that only differ in coefficient, keeps first occurrence order */
+static void merge_terms(struct term_list *list) {
+  u64 num_buckets = 64;
+  while (num_buckets < 2*list->num_terms) {
+    num_buckets *= 2;
+  }
+
+  /* Holds term index + 1 so 0 means empty */
+  u64 *buckets = calloc(num_buckets, sizeof(u64));
+  if (!buckets) {
+    die("Failed to calloc - %s\n", strerror(errno));
+  }
+
+  u64 n = 0;
+  for (u64 i = 0; i < list->num_terms; ++i) {
+    struct term *t = &list->terms[i];
+    u64 b = hash_term(t) & (num_buckets-1);
+    while (buckets[b] && !same_operators(&list->terms[buckets[b]-1], t)) {
+      b = (b+1) & (num_buckets-1);
+    }
+
+    if (buckets[b]) {
+      list->terms[buckets[b]-1].coeff += t->coeff;
+      STATS_ADD(terms_merged, 1);
+    } else {
+      list->terms[n] = *t;
+      buckets[b] = ++n;
+    }
+  }
+  list->num_terms = n;
+
+  free(buckets);
+}
+
+/* Expects the <statement> root produced by parse(), reuses the storage of e */
+static void expand(struct expansion *e, struct ast_node *root, struct symbol_table *tab) {
+  xassert(root->type == AST_BINARY_OP && root->name[0] == '=', "expand, root is not a statement\n");
+
+  u32 max_factors, max_sum_indices;
+  expand_check(root->children[1], &max_factors, &max_sum_indices);
+
+  e->list.num_terms = 0;
+  e->lhs = symbol_intern_cstr(tab, root->children[0]->name);
+  expand_node(root->children[1], tab, &e->list);
+  merge_terms(&e->list);
+
+  /* Drop terms that vanished */
+  u64 n = 0;
+  for (u64 i = 0; i < e->list.num_terms; ++i) {
+    if (e->list.terms[i].coeff != 0) {
+      e->list.terms[n++] = e->list.terms[i];
+    }
+  }
+  e->list.num_terms = n;
+}